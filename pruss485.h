@@ -0,0 +1,569 @@
+/*
+ * PRUSS Serial 485 character device interface (uio_pruss)
+ *
+ * ioctl() commands, mmap() areas and the structures exchanged with them,
+ * shared by the driver and user space.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation version 2.
+ */
+#ifndef _PRUSS485_H
+#define _PRUSS485_H
+
+#include <linux/types.h>
+
+/* ioctl() available commands */
+enum ioctl_cmd {
+	PRUSS_CLEAN = 10,
+	PRUSS_MODE,
+	PRUSS_SET_SYNC_STEP,
+	PRUSS_SET_PULSE_COUNT_SYNC,
+	PRUSS_GET_HW_ADDRESS,
+	PRUSS_BAUDRATE,
+	PRUSS_TIMEOUT,
+	PRUSS_GET_PULSE_COUNT_SYNC,
+	PRUSS_CLEAR_PULSE_COUNT_SYNC,
+	PRUSS_START_SYNC,
+	PRUSS_STOP_SYNC,
+	PRUSS_SET_ADDR_FILTER,
+	PRUSS_ATTACH_FILTER,
+	PRUSS_DETACH_FILTER,
+	PRUSS_ATTACH_CLIENT_FILTER,
+	PRUSS_DETACH_CLIENT_FILTER,
+	PRUSS_GET_RX_OVERFLOW,
+	PRUSS_MON_GET_DROPS,
+	PRUSS_ADD_REPLY,
+	PRUSS_DEL_REPLY,
+	PRUSS_CLEAR_REPLIES,
+	PRUSS_SET_REGMAP,
+	PRUSS_REGMAP_WAIT,
+	PRUSS_SET_POLL_LIST,
+	PRUSS_START_POLL,
+	PRUSS_STOP_POLL,
+	PRUSS_SEND_AT,
+	PRUSS_SET_TDMA,
+	PRUSS_GET_PULSE_COUNT64,
+	PRUSS_CLEAR_PULSE_COUNT64,
+	PRUSS_SET_SYNC_NOTIFY,
+	PRUSS_SYNC_WAIT,
+	PRUSS_SET_SYNC_PERIOD,
+	PRUSS_GET_SYNC_STATS,
+	PRUSS_RESET_SYNC_STATS,
+	PRUSS_GET_CLOCK_CORR,
+	PRUSS_IEP_TO_SYS,
+	PRUSS_SYS_TO_IEP,
+	PRUSS_SET_DELAY_CALIB,
+	PRUSS_GET_SYNC_DELAY,
+	PRUSS_SET_SYNC_STEP_SLOT,
+	PRUSS_SELECT_SYNC_STEP,
+	PRUSS_STAGE_CONFIG,
+	PRUSS_GET_SYNC_WINDOW,
+	PRUSS_SUBMIT,
+	PRUSS_REAP,
+	PRUSS_SETUP_RING,
+	PRUSS_RING_ENTER,
+	PRUSS_SET_DEADLINE,
+	PRUSS_CANCEL,
+	PRUSS_SET_PRIORITY,
+	PRUSS_SET_WEIGHT,
+	PRUSS_GET_CLIENT_STATS,
+};
+
+/* Areas mapped by mmap(), selected by the page offset */
+enum mmap_region {
+	PRUSS_MMAP_REGMAP,
+	PRUSS_MMAP_POLL,
+	PRUSS_MMAP_SYNC,
+	PRUSS_MMAP_RING,
+};
+
+/* Direction and link-layer errors of a frame, as in pcapng epb_flags */
+enum mon_flags {
+	MON_INBOUND = 0x1,
+	MON_OUTBOUND = 0x2,
+	MON_CHECKSUM_ERROR = 1 << 24,
+	MON_TOO_LONG = 1 << 25,
+};
+
+/* Slave reply cache, see PRUSS_ADD_REPLY. A received frame matches an entry
+ * if it is req_len bytes long and equals req on every bit set in mask. The
+ * driver then answers it with resp straight from the interruption handler. */
+#define REPLY_CACHE_SZ 16
+#define REPLY_REQ_MAX 32
+#define REPLY_RESP_MAX 256
+
+struct pruss_reply {
+	__u16 req_len;
+	__u16 resp_len;
+	__u8 req[REPLY_REQ_MAX];
+	__u8 mask[REPLY_REQ_MAX];
+	__u8 resp[REPLY_RESP_MAX];
+};
+
+/* Register table served in slave mode, see PRUSS_SET_REGMAP. Variables live
+ * in a page mapped with mmap() at PRUSS_MMAP_REGMAP, each at the given offset.
+ * Read and write variable requests (BSMP) addressed to this node are served
+ * by the interruption handler; writes to variables flagged REGMAP_NOTIFY are
+ * reported by PRUSS_REGMAP_WAIT and poll() (POLLPRI). */
+#define REGMAP_VARS_MAX 128
+#define REGMAP_VAR_SIZE_MAX 128
+
+enum regmap_flags {
+	REGMAP_WRITABLE = 0x01,
+	REGMAP_NOTIFY = 0x02,
+};
+
+struct pruss_regmap_var {
+	__u16 offset;
+	__u8 size;
+	__u8 flags;
+};
+
+struct pruss_regmap {
+	__u8 n_vars;
+	__u8 master_addr;
+	struct pruss_regmap_var vars[REGMAP_VARS_MAX];
+};
+
+/* The last 32 bits of the page are a sequence counter, which variables must
+ * not overlap. It is odd while variables are being updated. A writer, user
+ * space or the driver serving a write of the master, takes it from even to odd
+ * with an atomic compare and swap, and increments it once done; user space
+ * retries while it is odd, readers copy variables again if it was odd or
+ * changed meanwhile. A request arriving while it is odd, or changing while the
+ * answer is built, is handed to user space like any other frame. */
+#define REGMAP_SEQ_SIZE 4
+
+/* Time-triggered transmission, see PRUSS_SEND_AT. The request in buf is held
+ * in shared RAM and sent at launch_ns (CLOCK_MONOTONIC). lateness_ns returns
+ * how late the doorbell was rung and resp_len the length of the answer, which
+ * is then read with read(). */
+enum txtime_flags {
+	/* Fails with -ETIME instead of sending a frame which is already late */
+	PRUSS_TXTIME_DROP_LATE = 1,
+	/* Priority class of this transaction instead of the one of the file */
+	PRUSS_XFER_URGENT = 2,
+	PRUSS_XFER_CYCLIC = 4,
+	PRUSS_XFER_BULK = 8,
+};
+
+struct pruss_txtime {
+	__u64 launch_ns;
+	__u64 buf;
+	__u32 len;
+	__u32 flags;
+	__s64 lateness_ns;
+	__u32 resp_len;
+	__u32 reserved;
+};
+
+/* Priority classes of transmissions, set per file by PRUSS_SET_PRIORITY
+ * (cyclic by default) or per transaction by the flags above. The frame loaded
+ * next is always the oldest one of the most urgent class. */
+enum tx_prio {
+	PRUSS_PRIO_URGENT,
+	PRUSS_PRIO_CYCLIC,
+	PRUSS_PRIO_BULK,
+	PRUSS_PRIO_NR,
+};
+
+/* Bus usage of a file, see PRUSS_GET_CLIENT_STATS. Queueing delay runs from
+ * submission to the doorbell and bus time from the doorbell to the end of the
+ * transaction. queued is the number of transactions waiting. */
+struct pruss_client_stats {
+	__u64 xfers;
+	__u64 tx_bytes;
+	__u64 rx_bytes;
+	__u64 bus_ns;
+	__u64 queue_ns;
+	__u64 queue_max_ns;
+	__u32 weight;
+	__u32 queued;
+};
+
+/* Largest weight set by PRUSS_SET_WEIGHT */
+#define XFER_WEIGHT_MAX 64
+
+/* TDMA schedule shared by the masters of a bus, see PRUSS_SET_TDMA. It repeats
+ * at each sync pulse: slot i starts offset_us after the pulse and lasts
+ * length_us, during which only master node may transmit. Transactions of this
+ * master (whose node is given in the table) are held until they fit entirely,
+ * answer timeout included, in one of its slots. n_slots = 0 disables it.
+ * Slots must not overlap, must end within the sync period if it is known and
+ * at least one must belong to node. Setting a schedule fails with -EOPNOTSUPP
+ * if sync pulses are not timed (sync_sysevt). */
+#define TDMA_SLOTS_MAX 16
+
+struct pruss_tdma_slot {
+	__u32 offset_us;
+	__u32 length_us;
+	__u8 node;
+	__u8 reserved[3];
+};
+
+struct pruss_tdma_table {
+	__u8 n_slots;
+	__u8 node;
+	__u16 reserved;
+	struct pruss_tdma_slot slots[TDMA_SLOTS_MAX];
+};
+
+/* Sync pulse snapshot, mapped read only with mmap() at PRUSS_MMAP_SYNC and
+ * updated at each pulse. seq is odd while the page is being updated: readers
+ * copy it and retry if seq was odd or changed meanwhile. counter is the PRU
+ * pulse counter (COUNTER_OFFSET) at the last pulse, extended to 64 bits as
+ * PRUSS_GET_PULSE_COUNT64 returns it, last_ns its CLOCK_MONOTONIC timestamp. */
+enum sync_state {
+	PRUSS_SYNC_RUNNING = 1,
+};
+
+struct pruss_sync_page {
+	__u32 seq;
+	__u32 state;
+	__u64 pulses;
+	__u64 last_ns;
+	__u64 period_ns;
+	__u64 counter;
+};
+
+/* Sync pulse notification, see PRUSS_SET_SYNC_NOTIFY: eventfd (or -1 for
+ * none) is signalled at every pulse whose number, the 64-bit pulse counter,
+ * is a multiple of every. every also applies to PRUSS_SYNC_WAIT, which
+ * sleeps until such a pulse and returns it as a struct pruss_sync_event. */
+struct pruss_sync_notify {
+	__s32 eventfd;
+	__u32 every;
+};
+
+struct pruss_sync_event {
+	__u64 pulse;
+	__u64 ts_ns;
+};
+
+/* Sync pulse period statistics, measured between pulse interruptions.
+ * PRUSS_SET_SYNC_PERIOD gives the expected period and the width of the jitter
+ * histogram buckets, and resets the statistics. Bucket i counts the periods
+ * which deviate from the expected one by [(i - 16) * bucket_ns,
+ * (i - 15) * bucket_ns[, the first and last ones anything beyond. Without an
+ * expected period, deviations are taken from the first period measured. */
+#define SYNC_HIST_BUCKETS 32
+
+struct pruss_sync_period {
+	__u32 period_ns;
+	__u32 bucket_ns;
+};
+
+struct pruss_sync_stats {
+	__u64 samples;
+	__u64 period_ns;
+	__u64 mean_ns;
+	__u64 min_ns;
+	__u64 max_ns;
+	__u64 std_ns;
+	__u32 bucket_ns;
+	__u32 reserved;
+	__u32 hist[SYNC_HIST_BUCKETS];
+};
+
+/* PRU IEP timer correlation with CLOCK_MONOTONIC, see PRUSS_GET_CLOCK_CORR.
+ * The IEP counter is read along with the system clock every second and a
+ * servo estimates the system time at iep_ref and the IEP drift in ppb. IEP
+ * times are counted in ns, scaled by the counter increment, and extended to
+ * 64 bits by the driver; conversions (PRUSS_IEP_TO_SYS/PRUSS_SYS_TO_IEP,
+ * struct pruss_time_conv) take raw 32-bit counter values with
+ * PRUSS_CONV_RAW32, as the closest ones to iep_ref.
+ * uncertainty_ns is the width of the last sampling window. */
+enum clock_corr_flags {
+	PRUSS_CORR_LOCKED = 1,
+};
+
+struct pruss_clock_corr {
+	__u64 iep_ref;
+	__u64 sys_ref_ns;
+	__s64 drift_ppb;
+	__s64 last_error_ns;
+	__u32 uncertainty_ns;
+	__u32 flags;
+	__u64 samples;
+};
+
+enum time_conv_flags {
+	PRUSS_CONV_RAW32 = 1,
+};
+
+struct pruss_time_conv {
+	__u64 iep_ns;
+	__u64 sys_ns;
+	__u32 flags;
+	__u32 reserved;
+};
+
+/* Delay between the sync command and the next request, programmed by
+ * PRUSS_START_SYNC as a number of PRU delay loops (INSTR_COUNT_OFFSET, 24
+ * bits). Each loop lasts loop_ps and the loop itself costs overhead_ns, as
+ * measured for the firmware and set with PRUSS_SET_DELAY_CALIB, up to 1 us
+ * and 1 ms respectively. PRUSS_GET_SYNC_DELAY returns the last delay
+ * requested, the one actually programmed and whether it had to be clamped to
+ * the counter range. */
+#define DELAY_LOOP_PS_MAX 1000000
+#define DELAY_OVERHEAD_NS_MAX 1000000
+
+struct pruss_delay_calib {
+	__u32 loop_ps;
+	__u32 overhead_ns;
+};
+
+struct pruss_sync_delay {
+	__u64 requested_ns;
+	__u64 achieved_ns;
+	__u32 n_loops;
+	__u32 loop_ps;
+	__u32 overhead_ns;
+	__u32 clamped;
+};
+
+/* Sync step commands, sent by the PRU at each pulse. Up to SYNC_STEP_SLOTS
+ * commands are kept by the driver, set with PRUSS_SET_SYNC_STEP_SLOT: the
+ * driver builds the frame (size and checksum) and the length byte the
+ * firmware expects in front of it. Slot 0 holds the legacy command
+ * (ff 50 00 01 0c). PRUSS_SELECT_SYNC_STEP selects count slots from first,
+ * which are loaded in turn after each pulse, so that the next pulse sends the
+ * next one. */
+#define SYNC_STEP_SLOTS 8
+#define SYNC_STEP_PAYLOAD_MAX 24
+
+struct pruss_sync_step {
+	__u8 slot;
+	__u8 addr;
+	__u8 cmd;
+	__u8 len;
+	__u8 payload[SYNC_STEP_PAYLOAD_MAX];
+};
+
+struct pruss_sync_step_sel {
+	__u8 first;
+	__u8 count;
+	__u16 reserved;
+};
+
+/* Configuration changed without stopping sync, see PRUSS_STAGE_CONFIG. The
+ * fields selected by flags are staged and written right after the next
+ * pulse, between two sync commands, or at once if sync is stopped or pulses
+ * are not timed (no sync_sysevt module parameter). With
+ * PRUSS_STAGE_WAIT, the ioctl returns once they were written. */
+enum stage_flags {
+	PRUSS_STAGE_BAUD = 1,
+	PRUSS_STAGE_TIMEOUT = 2,
+	PRUSS_STAGE_COUNTER = 4,
+	PRUSS_STAGE_SYNC_STEP = 8,
+	PRUSS_STAGE_WAIT = 1 << 31,
+};
+
+struct pruss_staged_config {
+	__u32 flags;
+	__u32 baudrate;
+	__u32 timeout_ms;
+	__u16 counter;
+	__u8 sync_step;
+	__u8 reserved;
+};
+
+/* While sync runs, master transactions are only sent when they end, answer
+ * timeout included, before the next sync command. PRUSS_GET_SYNC_WINDOW
+ * returns the part of each cycle left to them, from the pulse. It fails with
+ * EAGAIN while sync is stopped or until a pulse period was measured. */
+struct pruss_sync_window {
+	__u64 period_ns;
+	__u64 begin_ns;
+	__u64 end_ns;
+};
+
+/* Tagged master transactions, see PRUSS_SUBMIT. Several transactions can be
+ * in flight for a file; each completes into the file completion queue, which
+ * PRUSS_REAP empties into an array of struct pruss_completion (up to max, or
+ * waiting for at least one with PRUSS_REAP_WAIT). The answer is copied into
+ * resp at reap time. poll() reports completions with POLLRDBAND. launch_ns
+ * works as with PRUSS_SEND_AT. */
+#define SUBMIT_INFLIGHT_MAX 64
+
+struct pruss_submit {
+	__u64 tag;
+	__u64 req;
+	__u64 resp;
+	__u32 req_len;
+	__u32 resp_max;
+	__u64 launch_ns;
+	__u32 flags;
+	__u32 reserved;
+};
+
+struct pruss_completion {
+	__u64 tag;
+	__s32 status;
+	__u32 resp_len;
+	__u64 t_submit_ns;
+	__u64 t_start_ns;
+	__u64 t_done_ns;
+};
+
+enum reap_flags {
+	PRUSS_REAP_WAIT = 1,
+};
+
+struct pruss_reap {
+	__u64 completions;
+	__u32 max;
+	__u32 flags;
+};
+
+/* Shared submission and completion rings, set up by PRUSS_SETUP_RING and
+ * mapped with mmap() at PRUSS_MMAP_RING. The area starts with struct
+ * pruss_ring_hdr, followed by the submission entries at sq_off, the
+ * completion entries (twice as many) at cq_off and one data slot per
+ * submission entry at data_off: the request at the start of the slot and the
+ * answer RING_REQ_MAX bytes further.
+ *
+ * User space fills a data slot and a submission entry naming it, then moves
+ * sq_tail; the driver moves sq_head as it takes entries. The driver posts
+ * completions at cq_tail and user space moves cq_head once it read them; a
+ * data slot can be reused once its completion was posted. Completions which
+ * find the ring full are counted in cq_overflow.
+ *
+ * PRUSS_RING_ENTER takes the new submissions, then waits for arg completions
+ * to be pending. With PRUSS_RING_SQPOLL, a kernel thread takes submissions
+ * instead; after idle_ms without any, it sets PRUSS_RING_NEED_WAKEUP in flags
+ * and sleeps until PRUSS_RING_ENTER. */
+#define RING_ENTRIES_MAX 256
+#define RING_REQ_MAX 512
+#define RING_RESP_MAX 512
+#define RING_SLOT_SIZE (RING_REQ_MAX + RING_RESP_MAX)
+
+enum ring_setup_flags {
+	PRUSS_RING_SQPOLL = 1,
+};
+
+/* PRUSS_CANCEL ends the transactions of the file, queued or running, with
+ * ECANCELED. With PRUSS_CANCEL_ALL, those of every file and a slave write
+ * waiting for the PRU are cancelled too. Running exchanges are abandoned and
+ * STATUS is set back to OLD_MESSAGE. */
+enum cancel_flags {
+	PRUSS_CANCEL_ALL = 1,
+};
+
+enum ring_flags {
+	PRUSS_RING_NEED_WAKEUP = 1,
+};
+
+struct pruss_ring_setup {
+	__u32 entries;
+	__u32 flags;
+	__u32 idle_ms;
+	__u32 size;
+};
+
+struct pruss_ring_hdr {
+	__u32 sq_head;
+	__u32 sq_tail;
+	__u32 cq_head;
+	__u32 cq_tail;
+	__u32 sq_entries;
+	__u32 cq_entries;
+	__u32 flags;
+	__u32 cq_overflow;
+	__u32 sq_off;
+	__u32 cq_off;
+	__u32 data_off;
+	__u32 slot_size;
+};
+
+struct pruss_sqe {
+	__u64 tag;
+	__u64 launch_ns;
+	__u16 req_len;
+	__u16 resp_max;
+	__u16 slot;
+	__u16 flags;
+};
+
+struct pruss_cqe {
+	__u64 tag;
+	__s32 status;
+	__u16 resp_len;
+	__u16 slot;
+	__u64 t_done_ns;
+};
+
+/* Cyclic poll list run by the driver in master mode, see PRUSS_SET_POLL_LIST.
+ * Every period_us, req is sent and the answer is published in the result
+ * table mapped with mmap() at PRUSS_MMAP_POLL, in entry slot. */
+#define POLL_ENTRIES_MAX 32
+#define POLL_REQ_MAX 64
+#define POLL_RESP_MAX 240
+
+struct pruss_poll_entry {
+	__u32 period_us;
+	__u16 slot;
+	__u16 req_len;
+	__u16 resp_max;
+	__u16 reserved;
+	__u8 req[POLL_REQ_MAX];
+};
+
+struct pruss_poll_list {
+	__u16 n_entries;
+	__u16 reserved;
+	struct pruss_poll_entry entries[POLL_ENTRIES_MAX];
+};
+
+/* Result table slot. seq is odd while the slot is being updated: readers copy
+ * the slot and retry if seq was odd or changed meanwhile. status is 0 or a
+ * negative error code; overruns counts cycles skipped because the previous
+ * transaction of the entry was still running. */
+struct pruss_poll_result {
+	__u32 seq;
+	__u16 len;
+	__s16 status;
+	__u64 ts_ns;
+	__u32 overruns;
+	__u32 reserved;
+	__u8 data[POLL_RESP_MAX];
+};
+
+/* Flight recorder record, as read from the trace attribute. Records are
+ * dumped in ring order: seq (0 for unused or partially written records)
+ * gives their chronological order. flags are the same as in epb_flags. */
+#define TRACE_DATA_LEN 44
+
+struct pruss_trace_rec {
+	__u32 seq;
+	__u32 flags;
+	__u64 ts_ns;
+	__u16 len;
+	__u8 cap_len;
+	__u8 reserved;
+	__u8 data[TRACE_DATA_LEN];
+};
+
+/* Destination address used by broadcast frames */
+#define PRUSS_ADDR_BROADCAST 0xff
+#define PRUSS_ADDR_FILTER_MAX 8
+
+/* Slave address filter flags */
+enum addr_filter_flags {
+	ADDR_FILTER_ENABLE = 0x01,
+	ADDR_FILTER_OWN = 0x02,
+	ADDR_FILTER_BROADCAST = 0x04,
+};
+
+/* Argument of PRUSS_SET_ADDR_FILTER. A frame is accepted in slave mode if
+ * its destination address (first byte) is the broadcast address or, after
+ * applying mask, equals the board address or one of the extra addresses. */
+struct pruss_addr_filter {
+	__u8 flags;
+	__u8 mask;
+	__u8 n_extra;
+	__u8 extra[PRUSS_ADDR_FILTER_MAX];
+};
+
+#endif /* _PRUSS485_H */
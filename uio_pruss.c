@@ -60,7 +60,12 @@ MODULE_PARM_DESC(extram_pool_sz, "external ram pool size to allocate");
  */
 #define MAX_PRUSS_EVT	8
 
+#define PINTC_SICR		0x0024
+#define PINTC_EISR		0x0028
 #define PINTC_HIDISR	0x0038
+#define PINTC_SRSR		0x0200
+#define PINTC_CMR		0x0400
+#define PINTC_HMR		0x0800
 #define PINTC_HIPIR		0x0900
 #define HIPIR_NOPEND	0x80000000
 #define PINTC_HIER		0x1500
@@ -86,6 +91,22 @@ static struct platform_device* _pdev;
 static int _pdev_c;
 /* Completion variable to signal an interruption */
 static DECLARE_COMPLETION(intr_completion);
+/* Serves PRU_EVTOUT events which do not need to wake any task up */
+static bool dev_irq_event (struct uio_pruss_dev *);
+/* System event raised by the PRU at each sync pulse and the host interruption
+ * it is mapped to (2 for PRU_EVTOUT0 to 9 for PRU_EVTOUT7, but PRU_EVTOUT).
+ * Pulses are only timed if the firmware raises such an event: both are -1 by
+ * default. */
+static int sync_evtout = -1;
+module_param(sync_evtout, int, 0444);
+MODULE_PARM_DESC(sync_evtout, "host interruption (2-9, not 3) the sync pulse event is mapped to, -1 to disable");
+static int sync_sysevt = -1;
+module_param(sync_sysevt, int, 0444);
+MODULE_PARM_DESC(sync_sysevt, "system event (0-63) raised by the PRU firmware at each sync pulse, -1 to disable");
+/* Timestamps sync pulses and runs what is aligned to them */
+static void dev_sync_irq (struct uio_pruss_dev *);
+/* Starts the IEP counter unless the firmware runs it */
+static void dev_iep_start (void);
 #endif
 
 static ssize_t store_sync_ddr(struct device *dev, struct device_attribute *attr,  char *buf, size_t count) {
@@ -131,9 +152,21 @@ static irqreturn_t pruss_handler(int irq, struct uio_info *info)
 
 #ifdef PRUSS_CHAR_DEVICE
 	/* If the interruption corresponds to PRU_EVTOUT, we must signal
-	 * other tasks, which might be waiting. */
-	if (intr_bit == PRU_EVTOUT)
+	 * other tasks, which might be waiting, unless the event was already
+	 * served here. In that case, the interruption is kept enabled. */
+	if (intr_bit == PRU_EVTOUT) {
+		if (dev_irq_event(gdev))
+			return IRQ_HANDLED;
 		complete(&intr_completion);
+	}
+
+	/* Sync pulses are served here and the interruption is kept enabled.
+	 * Other events mapped to the same host interruption go to UIO. */
+	if (intr_bit == sync_evtout && sync_sysevt >= 0 &&
+			(ioread32(base + PINTC_SRSR + ((sync_sysevt >> 5) << 2)) & (1 << (sync_sysevt & 31)))) {
+		dev_sync_irq(gdev);
+		return IRQ_HANDLED;
+	}
 #endif
 
 	/* Disable interrupt */
@@ -354,6 +387,9 @@ static int pruss_probe(struct platform_device *dev)
 		goto out_free;
 
 	platform_set_drvdata(dev, gdev);
+#ifdef PRUSS_CHAR_DEVICE
+	dev_iep_start();
+#endif
 	return 0;
 
 	out_free:
@@ -400,12 +436,67 @@ static struct platform_driver pruss_driver = {
 /* API support for variable completion */
 #include <linux/completion.h>
 
+/* Frames received in slave mode are handed over through a wait queue */
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+
+/* Classic BPF programs may be attached to the reception path */
+#include <linux/filter.h>
+#include <linux/rcupdate.h>
+
+/* Received frames are published into a ring shared by all readers */
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+
+/* Tables shared with user space through mmap() */
+#include <linux/mm.h>
+
+/* Master transactions are timed by high resolution timers */
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+
+/* Sync pulses are notified through eventfd */
+#include <linux/eventfd.h>
+#include <linux/version.h>
+
+/* Sync statistics are also exposed in debugfs */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+
+/* PRU and system clocks are correlated periodically */
+#include <linux/workqueue.h>
+
+/* Shared rings may be served by a kernel thread */
+#include <linux/kthread.h>
+#include <linux/jiffies.h>
+
+/* Reads and writes may be asynchronous */
+#include <linux/fs.h>
+#include <linux/uio.h>
+
+/* ioctl() commands and structures shared with user space */
+#include "pruss485.h"
+
 #define  DEVICE_NAME "pruss485"
 #define  CLASS_NAME  "pruss485"
+#define  MON_DEVICE_NAME "pruss485-mon"
+
+/* Minor numbers of the character devices */
+enum minor {
+	PRUSS_MINOR,
+	PRUSS_MON_MINOR,
+};
 
 /* Offset of memory areas and register offsets.
  * Refer to table 5 of the AM335x PRU Reference Guide*/
 #define PRUSS_SHAREDRAM_BASE 0x10000
+#define PRUSS_IEP_BASE 0x2E000
+#define IEP_GLOBAL_CFG 0x00
+#define IEP_COUNT 0x0C
 #define PINTC_HIEISR 0x0034
 #define PRU_INTC_SECR1_REG 0x280
 #define SRAM_SIZE 0x3000
@@ -425,21 +516,6 @@ static struct platform_driver pruss_driver = {
 #define GPIO_P8_34 81
 #define GPIO_P8_35 8
 
-/* ioctl() available commands */
-enum ioctl_cmd {
-	PRUSS_CLEAN = 10,
-	PRUSS_MODE,
-	PRUSS_SET_SYNC_STEP,
-	PRUSS_SET_PULSE_COUNT_SYNC,
-	PRUSS_GET_HW_ADDRESS,
-	PRUSS_BAUDRATE,
-	PRUSS_TIMEOUT,
-	PRUSS_GET_PULSE_COUNT_SYNC,
-	PRUSS_CLEAR_PULSE_COUNT_SYNC,
-	PRUSS_START_SYNC,
-	PRUSS_STOP_SYNC,
-};
-
 /* Shared RAM memory offsets */
 enum offset {
 	STATUS_OFFSET = 1,
@@ -458,21 +534,441 @@ enum offset {
 	SHRAM_READ_OFFSET = 0x1800,
 };
 
+/* Largest frames which fit into the reading and writing areas of the shared RAM */
+#define RX_FRAME_MAX (SRAM_SIZE - SHRAM_READ_OFFSET - 4)
+#define TX_FRAME_MAX (SHRAM_READ_OFFSET - SHRAM_WRITE_OFFSET - 4)
+
+/* Bus monitor capture format: pcapng, one interface with a private link type.
+ * Timestamps are in nanoseconds (if_tsresol = 9). */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_LINKTYPE_USER0 147
+#define PCAPNG_OPT_TSRESOL 9
+#define PCAPNG_OPT_EPB_FLAGS 2
+
+struct pcapng_shb {
+	u32 type;
+	u32 total_len;
+	u32 magic;
+	u16 major;
+	u16 minor;
+	u64 section_len;
+	u32 total_len_end;
+} __packed;
+
+struct pcapng_idb {
+	u32 type;
+	u32 total_len;
+	u16 link_type;
+	u16 reserved;
+	u32 snap_len;
+	u16 tsresol_code;
+	u16 tsresol_len;
+	u8 tsresol;
+	u8 pad[3];
+	u32 end_of_opt;
+	u32 total_len_end;
+} __packed;
+
+/* Enhanced packet block, up to the frame data. It is followed by the data
+ * padded to 4 bytes and by struct pcapng_epb_tail. */
+struct pcapng_epb {
+	u32 type;
+	u32 total_len;
+	u32 interface;
+	u32 ts_high;
+	u32 ts_low;
+	u32 cap_len;
+	u32 orig_len;
+} __packed;
+
+struct pcapng_epb_tail {
+	u16 flags_code;
+	u16 flags_len;
+	u32 flags;
+	u32 end_of_opt;
+	u32 total_len;
+} __packed;
+
+/* BSMP commands and answers handled by the register table */
+enum bsmp_cmd {
+	BSMP_READ_VAR = 0x10,
+	BSMP_READ_VAR_ANSWER = 0x11,
+	BSMP_WRITE_VAR = 0x20,
+	BSMP_OK = 0xe0,
+	BSMP_ERR_INVALID_ID = 0xe3,
+	BSMP_ERR_INVALID_SIZE = 0xe5,
+	BSMP_ERR_READ_ONLY = 0xe6,
+};
+
+struct pruss_flow;
+
+/* Master transaction: a request sent by the driver and the answer to it. done
+ * is called once the transaction is over, from interruption or timer context,
+ * with status set to 0 or a negative error code. owner identifies who
+ * submitted it, so its transactions can be cancelled, and flow the transmit
+ * queue it waits in. */
+struct pruss_xfer {
+	struct list_head node;
+	const u8 *req;
+	u32 req_len;
+	u8 *resp;
+	u32 resp_max;
+	u32 resp_len;
+	int status;
+	ktime_t t_submit;
+	ktime_t t_launch;
+	ktime_t t_start;
+	ktime_t t_done;
+	u32 flags;
+	u8 prio;
+	void *owner;
+	struct pruss_flow *flow;
+	void (*done)(struct pruss_xfer *);
+	void *priv;
+};
+
+#define PRUSS_XFER_FLAGS (PRUSS_TXTIME_DROP_LATE | PRUSS_XFER_URGENT | PRUSS_XFER_CYCLIC | PRUSS_XFER_BULK)
+
+/* Transmit queues of a file, one per priority class. Within a class, the
+ * files with queued transactions take turns by deficit round robin: a turn
+ * adds weight * XFER_QUANTUM bytes to the deficit of the file, and each
+ * transaction costs its request and answer bytes once over. The turn passes
+ * when the deficit is spent. All flows are in xfer_flow_all. */
+#define XFER_QUANTUM 256
+
+struct pruss_flow {
+	struct list_head queue[PRUSS_PRIO_NR];
+	struct list_head node[PRUSS_PRIO_NR];
+	s32 deficit[PRUSS_PRIO_NR];
+	u32 weight;
+	struct list_head all;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	struct pruss_client_stats stats;
+};
+
+/* Frames launched later than this are dropped with PRUSS_TXTIME_DROP_LATE */
+#define TXTIME_LATE_NS (20 * NSEC_PER_USEC)
+
+/* IEP clock period (200 MHz). At each clock, the counter adds the increment
+ * set in IEP_GLOBAL_CFG: the driver starts it with IEP_CLK_NS, 1 ns per count. */
+#define IEP_CLK_NS 5
+#define IEP_CNT_ENABLE 0x1
+#define IEP_DEFAULT_INC(cfg) (((cfg) >> 4) & 0xf)
+/* Correlation sampling period and number of reads kept for the best one */
+#define CORR_PERIOD_MS 1000
+#define CORR_READS 4
+/* Errors beyond this step the servo instead of slewing it */
+#define CORR_STEP_NS (100 * NSEC_PER_USEC)
+/* Servo locked after this many samples below CORR_LOCK_NS */
+#define CORR_LOCK_SAMPLES 4
+#define CORR_LOCK_NS 1000
+
+#define INSTR_COUNT_MAX 0xffffff
+
+/* Period deviations are clamped to this in the mean and standard deviation,
+ * so that a missed pulse does not overflow their squares */
+#define SYNC_DEV_MAX_NS NSEC_PER_SEC
+
+/* Sync step command area of the shared RAM, length byte included */
+#define SYNC_STEP_LEN (COUNTER_OFFSET - SYNC_STEP_OFFSET)
+
+/* Poll interval of the submission ring thread */
+#define RING_POLL_US 20
+
+/* Classic BPF program attached by PRUSS_ATTACH_FILTER (struct sock_fprog, as
+ * in SO_ATTACH_FILTER). It runs on each accepted frame: a return value of 0
+ * drops the frame, any other value truncates it to at most that many bytes. */
+struct pruss_rx_prog {
+	struct rcu_head rcu;
+	u16 len;
+	struct sock_filter insns[0];
+};
+
+/* Entry of the reception ring. seq is the ring position plus one and is
+ * cleared while the frame is rewritten, so readers can detect they lost it. */
+struct pruss_rx_frame {
+	u32 seq;
+	u32 len;
+	u8 data[RX_FRAME_MAX];
+};
+
+/* Per open file state */
+struct pruss_client {
+	/* Slave mode: position in the reception ring, under lock */
+	u32 rx_cursor;
+	u32 rx_overflow;
+	struct pruss_rx_prog __rcu *rx_prog;
+	/* Master mode: last answer to a request written on this file */
+	struct mutex lock;
+	u8 *req;
+	u8 *resp;
+	u32 resp_len;
+	/* Sync pulse notification: in sync_clients while sync_efd is set */
+	struct list_head sync_node;
+	struct eventfd_ctx *sync_efd;
+	u32 sync_every;
+	/* Tagged transactions: completed ones wait in cq for PRUSS_REAP */
+	spinlock_t cq_lock;
+	struct list_head cq;
+	wait_queue_head_t cq_wait;
+	u32 inflight;
+	/* Answers to asynchronous writes, under cq_lock, for the next reads.
+	 * aio_inflight counts the asynchronous writes not read yet; they only
+	 * hold an inflight slot until their request is completed. */
+	struct list_head answers;
+	u32 aio_inflight;
+	/* Shared rings, set up once, under lock */
+	struct pruss_ring *ring;
+	/* Longest wait of a blocking write, in ms, 0 for none */
+	u32 deadline_ms;
+	/* Priority class of transmissions */
+	u8 prio;
+	/* Transmit queues, under xfer_lock */
+	struct pruss_flow flow;
+};
+
+/* Transaction taken from a submission ring, one per data slot */
+struct pruss_ring_cmd {
+	struct pruss_xfer xfer;
+	struct pruss_ring *ring;
+	u64 tag;
+	u16 slot;
+	bool busy;
+	u8 req[RING_REQ_MAX];
+};
+
+/* Shared rings of a file. area is what is mapped; sq_head and cq_tail are the
+ * driver copies of the indices it owns. sq_mutex serialises the consumers of
+ * the submission ring, cq_lock the producers of the completion ring. */
+struct pruss_ring {
+	struct pruss_client *client;
+	void *area;
+	size_t size;
+	struct pruss_ring_hdr *hdr;
+	struct pruss_sqe *sqes;
+	struct pruss_cqe *cqes;
+	u8 *data;
+	u32 entries;
+	u32 sq_head;
+	u32 cq_tail;
+	struct mutex sq_mutex;
+	spinlock_t cq_lock;
+	struct pruss_ring_cmd *cmds;
+	struct task_struct *poller;
+	wait_queue_head_t poller_wait;
+	bool wake;
+	u32 idle_ms;
+};
+
+/* Tagged transaction, as submitted by PRUSS_SUBMIT, or asynchronous write,
+ * completing iocb */
+struct pruss_cmd {
+	struct pruss_xfer xfer;
+	struct pruss_client *client;
+	struct kiocb *iocb;
+	u64 tag;
+	u64 user_resp;
+	u8 req[TX_FRAME_MAX];
+	u8 resp[];
+};
+
+static int rx_ring_sz = 32;
+module_param(rx_ring_sz, int, 0);
+MODULE_PARM_DESC(rx_ring_sz, "number of received frames kept for the readers (power of 2)");
+
+static int mon_pool_sz = SZ_128K;
+module_param(mon_pool_sz, int, 0);
+MODULE_PARM_DESC(mon_pool_sz, "bus monitor buffer size (4K to 4M), allocated while a capture runs");
+
+static int trace_pool_sz = SZ_64K;
+module_param(trace_pool_sz, int, 0);
+MODULE_PARM_DESC(trace_pool_sz, "flight recorder buffer size");
+
 static int majorNumber;
-static u8 message[SRAM_SIZE] = {0};
+static u8 tx_frame[TX_FRAME_MAX];
 
-/* mutex protecting read and writing order */
+/* mutex protecting writing order */
 static DEFINE_MUTEX(pruchar_mutex);
+/* Slave writers waiting for pruchar_mutex, per priority class, under rx_lock */
+static u32 tx_waiters[PRUSS_PRIO_NR];
+
+/* Slave mode reception: the interruption handler publishes frames into rx_ring
+ * and each reader follows it with its own cursor. Writers hold rx_lock, readers
+ * only check the sequence numbers. rx_spare is the frame being filled. */
+static DEFINE_SPINLOCK(rx_lock);
+static DECLARE_WAIT_QUEUE_HEAD(rx_wait);
+static struct pruss_rx_frame **rx_ring, *rx_spare, *rx_frames;
+static u32 rx_head;
+static struct pruss_addr_filter addr_filter;
+static u8 own_addr;
+static struct pruss_rx_prog __rcu *rx_prog;
+/* Set while dev_write_iter() waits for the end of a transmission, by
+ * tx_owner. tx_cancelled is set by PRUSS_CANCEL to abandon it. */
+static bool tx_pending;
+static struct pruss_client *tx_owner;
+static bool tx_cancelled;
+
+/* Set while a frame sent by the driver itself is being transmitted. Writers
+ * wait on tx_wait for it to finish. Both flags are changed under rx_lock. */
+static bool tx_kernel;
+static DECLARE_WAIT_QUEUE_HEAD(tx_wait);
+
+/* Slave reply cache, protected by rx_lock */
+static struct pruss_reply reply_cache[REPLY_CACHE_SZ];
+static u16 reply_valid;
+
+/* Register table, protected by rx_lock. The page is kept until the module
+ * exits since it may still be mapped. regmap_resp holds the answers. */
+static struct pruss_regmap regmap;
+static u8 *regmap_page;
+static u8 regmap_resp[REGMAP_VAR_SIZE_MAX + 5];
+static DECLARE_BITMAP(regmap_changed, REGMAP_VARS_MAX);
+static DECLARE_WAIT_QUEUE_HEAD(regmap_wait);
+
+/* Master transactions: queued ones wait in the queues of their flow for the
+ * active one to finish. xfer_flows lists, per priority class, the flows with
+ * queued transactions, in the order of their turns. While a transaction is
+ * active, xfer_timer polls STATUS and enforces its deadline. xfer_idle is
+ * woken each time a transaction finishes. */
+static DEFINE_SPINLOCK(xfer_lock);
+static struct list_head xfer_flows[PRUSS_PRIO_NR] = {
+	LIST_HEAD_INIT(xfer_flows[PRUSS_PRIO_URGENT]),
+	LIST_HEAD_INIT(xfer_flows[PRUSS_PRIO_CYCLIC]),
+	LIST_HEAD_INIT(xfer_flows[PRUSS_PRIO_BULK]),
+};
+static LIST_HEAD(xfer_flow_all);
+static struct pruss_xfer *xfer_active;
+static struct hrtimer xfer_timer;
+static ktime_t xfer_deadline;
+/* The active transaction is loaded and waits for its launch time or slot */
+static bool xfer_launching;
+/* The active transaction was cancelled: xfer_timer ends it at its next look */
+static bool xfer_abort;
+/* A cancelled exchange may still be on the wire until xfer_deadline: no frame
+ * is loaded meanwhile */
+static bool xfer_quiet;
+/* TDMA schedule, changed under xfer_lock */
+static struct pruss_tdma_table tdma;
+
+/* Sync pulses, as timestamped by dev_sync_irq(). sync_period_ns is the time
+ * between the two last pulses, 0 until two pulses were seen. */
+static DEFINE_SPINLOCK(sync_lock);
+static ktime_t sync_last;
+static u64 sync_period_ns;
+static u64 sync_pulses;
+static u32 sync_state;
+/* PRU pulse counter extended to 64 bits: sync_raw is its last value read and
+ * sync_count_base the extended value at the last PRUSS_CLEAR_PULSE_COUNT64 */
+static u16 sync_raw;
+static u64 sync_count;
+static u64 sync_count_base;
+/* Period statistics, under sync_lock. Sums are kept as deviations from
+ * sync_ref_ns, so that squares do not overflow. */
+static u32 sync_nominal_ns;
+static u32 sync_bucket_ns = 1000;
+static u64 sync_ref_ns;
+static u64 sync_samples;
+static s64 sync_dev_sum;
+static u64 sync_dev_sq_sum;
+static u64 sync_min_ns;
+static u64 sync_max_ns;
+static u32 sync_hist[SYNC_HIST_BUCKETS];
+static struct dentry *pruss_debugfs;
+/* IEP correlation, under clk_lock. iep_last is the last raw counter value,
+ * extended into iep_ext in ns, iep_rem what is left of it below 1 ns.
+ * iep_ref_raw is the counter value at clk_corr.iep_ref and iep_inc the
+ * increment the IEP runs with. */
+static DEFINE_SPINLOCK(clk_lock);
+static struct delayed_work clk_work;
+static struct pruss_clock_corr clk_corr;
+static u32 iep_last;
+static u64 iep_ext;
+static u32 iep_rem;
+static u32 iep_ref_raw;
+static u32 iep_inc = IEP_CLK_NS;
+static u32 clk_good;
+/* Files notified at sync pulses through eventfd, and PRUSS_SYNC_WAIT sleepers */
+static LIST_HEAD(sync_clients);
+static DECLARE_WAIT_QUEUE_HEAD(sync_wait);
+static struct pruss_sync_page *sync_page;
+/* PRU delay loop calibration and last sync delay programmed, under sync_lock */
+static struct pruss_delay_calib delay_calib = { .loop_ps = 10000, };
+static struct pruss_sync_delay sync_delay;
+/* Sync step commands, as loaded into SYNC_STEP_OFFSET, under sync_lock.
+ * sync_step_cur is the slot loaded, in the selection of sync_step_count slots
+ * from sync_step_first. sync_step_pending asks the sync interruption to load
+ * a new selection. */
+static u8 sync_steps[SYNC_STEP_SLOTS][SYNC_STEP_LEN] = {
+	{ 0x06, 0xff, 0x50, 0x00, 0x01, 0x0c, 0xa4 },
+};
+static u8 sync_step_first;
+static u8 sync_step_count = 1;
+static u8 sync_step_cur;
+static bool sync_step_pending;
+/* Staged configuration, written by the sync interruption, and number of
+ * configurations written so far */
+static struct pruss_staged_config sync_staged;
+static u32 sync_staged_seq;
+static DECLARE_WAIT_QUEUE_HEAD(xfer_idle);
+/* Answer timeout configured by PRUSS_TIMEOUT, in ms */
+static unsigned long timeout_ms = 10;
+
+/* Cyclic poll list, changed under poll_mutex while it is not running */
+struct pruss_poll {
+	struct pruss_poll_entry entry;
+	struct pruss_xfer xfer;
+	ktime_t next;
+	bool busy;
+	u8 resp[POLL_RESP_MAX];
+};
+
+static DEFINE_MUTEX(poll_mutex);
+static struct pruss_poll *poll_list;
+static struct pruss_flow poll_flow;
+static u16 poll_n;
+static bool poll_running;
+static struct hrtimer poll_timer;
+static struct pruss_poll_result *poll_results;
+
+/* Bus monitor: pcapng blocks are appended to a byte ring, allocated while
+ * /dev/pruss485-mon is open. Whole blocks are dropped if the
+ * reader is late, so the stream stays well formed. */
+static DEFINE_SPINLOCK(mon_lock);
+static DECLARE_WAIT_QUEUE_HEAD(mon_wait);
+static u8 *mon_buf;
+static u32 mon_size, mon_head, mon_tail, mon_drops, mon_hdr_off;
+static atomic_t mon_users = ATOMIC_INIT(0);
+static bool mon_active;
+/* Readers of the capture share mon_hdr_off and mon_tail */
+static DEFINE_MUTEX(mon_read_mutex);
+
+/* Flight recorder: the most recent frames, always recorded. Producers only
+ * take a slot with trace_idx and never wait for each other. */
+static struct pruss_trace_rec *trace_buf;
+static u32 trace_entries;
+static atomic_t trace_idx = ATOMIC_INIT(0);
 
 static struct class* prucharClass  = NULL;
 static struct device* prucharDevice = NULL;
+static struct device* prucharMonDevice = NULL;
 
 /* struct file_operations function prototypes */
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
 static long    dev_unlocked_ioctl (struct file *, unsigned int, unsigned long);
+static unsigned int dev_poll (struct file *, poll_table *);
+static int     dev_mmap (struct file *, struct vm_area_struct *);
+static int     mon_open(struct inode *, struct file *);
+static int     mon_release(struct inode *, struct file *);
+static ssize_t mon_read(struct file *, char *, size_t, loff_t *);
+static unsigned int mon_poll (struct file *, poll_table *);
+static long    mon_unlocked_ioctl (struct file *, unsigned int, unsigned long);
 
 /* application specific function prototypes */
 static int init_gpio (unsigned int id, const char *);
@@ -481,15 +977,30 @@ static int dev_set_sync_counter (void __iomem *, unsigned long);
 static int dev_clear_count_sync (void __iomem *);
 static int dev_set_sync_stop (void __iomem *);
 static int dev_set_sync_start (u32, void __iomem *);
+static void dev_apply_staged_locked (void __iomem *);
+static bool dev_sync_timed (void);
 static int dev_config_baudrate (void __iomem *, unsigned long);
 
 /* file operations for file /dev/pru485 */
 static struct file_operations fops = {
+		.owner = THIS_MODULE,
 		.open = dev_open,
-		.read = dev_read,
-		.write = dev_write,
+		.read_iter = dev_read_iter,
+		.write_iter = dev_write_iter,
 		.release = dev_release,
 		.unlocked_ioctl = dev_unlocked_ioctl,
+		.poll = dev_poll,
+		.mmap = dev_mmap,
+};
+
+/* file operations for file /dev/pruss485-mon */
+static struct file_operations mon_fops = {
+		.owner = THIS_MODULE,
+		.open = mon_open,
+		.read = mon_read,
+		.release = mon_release,
+		.unlocked_ioctl = mon_unlocked_ioctl,
+		.poll = mon_poll,
 };
 
 /* Character device functions */
@@ -554,12 +1065,14 @@ static int dev_set_sync_start (u32 delay_us, void __iomem *io_vaddr) {
 
 	if (ioread8(io_vaddr + MODE_OFFSET) == 'M') {
 
+		struct pruss_delay_calib calib;
 		u8 i;
-		u32 delay_ns, n_loops;
+		u64 delay_ns, loop_ns;
+		u32 n_loops;
 
 		dev_clear_count_sync(io_vaddr);
 
-		delay_ns = delay_us * 1000;
+		delay_ns = (u64) delay_us * NSEC_PER_USEC;
 
 		/* Delay entre comando de sincronismo e requisicao qualquer */
 		/* Calculo do delay */
@@ -567,8 +1080,23 @@ static int dev_set_sync_start (u32 delay_us, void __iomem *io_vaddr) {
 		for (i = 0; i < 3; i++)
 			delay_ns += (ioread8(io_vaddr + BAUD_LENGTH_OFFSET + i) << (i * 8));
 
-		/* numero de loops = delay / 10 ns */
-		n_loops = delay_ns/10;
+		spin_lock_irq(&sync_lock);
+		calib = delay_calib;
+		spin_unlock_irq(&sync_lock);
+
+		/* numero de loops = (delay - custo do laco) / duracao de um laco */
+		loop_ns = delay_ns > calib.overhead_ns ? delay_ns - calib.overhead_ns : 0;
+		n_loops = min_t(u64, div_u64(loop_ns * 1000, calib.loop_ps), INSTR_COUNT_MAX);
+
+		/* Read by the sync window under sync_lock */
+		spin_lock_irq(&sync_lock);
+		sync_delay.requested_ns = delay_ns;
+		sync_delay.n_loops = n_loops;
+		sync_delay.loop_ps = calib.loop_ps;
+		sync_delay.overhead_ns = calib.overhead_ns;
+		sync_delay.achieved_ns = div_u64((u64) n_loops * calib.loop_ps, 1000) + calib.overhead_ns;
+		sync_delay.clamped = n_loops == INSTR_COUNT_MAX;
+		spin_unlock_irq(&sync_lock);
 
 		/* armazena numero de instrucoes */
 		for (i = 0; i < 3; i++)
@@ -582,7 +1110,18 @@ static int dev_set_sync_start (u32 delay_us, void __iomem *io_vaddr) {
 	return -1;
 }
 
-/* Configures serial baudrate */
+static int dev_get_sync_delay (unsigned long arg) {
+
+	struct pruss_sync_delay delay;
+
+	spin_lock_irq(&sync_lock);
+	delay = sync_delay;
+	spin_unlock_irq(&sync_lock);
+
+	return copy_to_user((void __user *) arg, &delay, sizeof(delay)) ? -EFAULT : 0;
+}
+
+/* Configures serial baudrate, or only checks it if io_vaddr is NULL */
 static int dev_config_baudrate (void __iomem *io_vaddr, unsigned long baudrate) {
 
 	u8 brgconfig, div_lsb, div_msb;
@@ -657,6 +1196,10 @@ static int dev_config_baudrate (void __iomem *io_vaddr, unsigned long baudrate)
 		return -EINVAL;
 	}
 
+	/* Only checks the baudrate */
+	if (!io_vaddr)
+		return 0;
+
 	iowrite8(brgconfig, io_vaddr + BAUD_BRGCONFIG_OFFSET);
 	iowrite8(div_lsb, io_vaddr + BAUD_LSB_OFFSET);
 	iowrite8(div_msb, io_vaddr + BAUD_MSB_OFFSET);
@@ -704,316 +1247,4452 @@ static int dev_set_sync_stop (void __iomem *io_vaddr) {
 
 }
 
+/* Loads a sync step command: length byte and frame */
+static void dev_load_sync_step (void __iomem *io_vaddr, const u8 *step) {
+
+	u8 count;
+
+	for (count = 0; count <= step[0]; count++)
+		iowrite8(step[count], io_vaddr + SYNC_STEP_OFFSET + count);
+}
+
+/* Loads the selected sync step command */
 static int dev_set_sync_step (void __iomem *io_vaddr) {
 
-	iowrite8(0x06, io_vaddr + SYNC_STEP_OFFSET);
-	iowrite8(0xff, io_vaddr + SYNC_STEP_OFFSET + 1);
-	iowrite8(0x50, io_vaddr + SYNC_STEP_OFFSET + 2);
-	iowrite8(0x00, io_vaddr + SYNC_STEP_OFFSET + 3);
-	iowrite8(0x01, io_vaddr + SYNC_STEP_OFFSET + 4);
-	iowrite8(0x0c, io_vaddr + SYNC_STEP_OFFSET + 5);
-	iowrite8(0xa4, io_vaddr + SYNC_STEP_OFFSET + 6);
+	spin_lock_irq(&sync_lock);
+	dev_load_sync_step(io_vaddr, sync_steps[sync_step_cur]);
+	spin_unlock_irq(&sync_lock);
 
 	return 0;
 }
 
-/* Initialization procedure of the character device. Initializes mutexes and registers the device */
-static int __init pru_driver_init(void) {
+/* Loads a frame into the writing area of the shared RAM */
+static void dev_load_tx (void __iomem *io_vaddr, const u8 *data, u32 len) {
 
-	printk(KERN_INFO "PRU KVM: initializing module.\n");
+	u32 count;
 
-	/* Registering pruss_driver */
-	platform_driver_register(&pruss_driver);
-	_pdev_c = 0;
+	/* SHRAM_WRITE_OFFSET is not 4-byte aligned, so we need to write
+	 * each byte at a time */
+	iowrite8(len & 0xff, io_vaddr + SHRAM_WRITE_OFFSET);
+	iowrite8((len >> 8) & 0xff, io_vaddr + SHRAM_WRITE_OFFSET + 1);
+	iowrite8((len >> 16) & 0xff, io_vaddr + SHRAM_WRITE_OFFSET + 2);
+	iowrite8((len >> 24) & 0xff, io_vaddr + SHRAM_WRITE_OFFSET + 3);
 
-	mutex_init(&pruchar_mutex);
+	for (count = 0; count < len; count++)
+		iowrite8(data[count], io_vaddr + SHRAM_WRITE_OFFSET + 4 + count);
+}
 
-	majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
-	if (majorNumber < 0) {
+/* Clears the system event and re-enables the PRU_EVTOUT interruption */
+static void dev_intc_rearm (void __iomem *intrc) {
 
-		printk(KERN_ALERT "PRU KVM: failed to register a major number.\n");
-		return majorNumber;
-	}
-	printk(KERN_INFO "PRU KVM: registered correctly with major number %d\n", majorNumber);
+	iowrite32(1 << PRU_ARM_INTERRUPT, intrc + PRU_INTC_SECR1_REG);
+	iowrite32(1 << PRU_EVTOUT, intrc + PINTC_HIEISR);
+}
 
-	prucharClass = class_create(THIS_MODULE, CLASS_NAME);
-	if (IS_ERR(prucharClass)) {
+/* Reads the length of the frame stored at SHRAM_READ_OFFSET, as written by the PRU */
+static u32 dev_rx_length_raw (void __iomem *io_vaddr) {
 
-		unregister_chrdev(majorNumber, DEVICE_NAME);
-		printk(KERN_ALERT "PRU KVM: failed to register device class.\n");
-		return PTR_ERR(prucharClass);
-	}
-	printk(KERN_INFO "PRU KVM: device class registered correctly\n");
+	u32 count = 0;
+	u8 i;
 
-	prucharDevice = device_create(prucharClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-	if (IS_ERR(prucharDevice)){
+	for (i = 0; i < 4; i++)
+		count |= (ioread8(io_vaddr + SHRAM_READ_OFFSET + i) << (i * 8));
 
-		mutex_destroy(&pruchar_mutex);
-		class_destroy(prucharClass);
-		unregister_chrdev(majorNumber, DEVICE_NAME);
-		printk(KERN_ALERT "PRU KVM: Failed to create the device\n");
-		return PTR_ERR(prucharDevice);
-	}
+	return count;
+}
 
-	printk(KERN_INFO "PRU KVM: device class created correctly\n");
+/* Length of the frame stored at SHRAM_READ_OFFSET which can actually be read */
+static u32 dev_rx_length (void __iomem *io_vaddr) {
 
-	return 0;
+	return min_t(u32, dev_rx_length_raw(io_vaddr), RX_FRAME_MAX);
 }
 
-/* Exits device and releases all resources. */
-static void __exit pru_driver_exit(void) {
+/* Frames end with a checksum byte which makes the sum of all bytes zero */
+static bool dev_frame_checksum_ok (const u8 *data, u32 len) {
 
-	platform_driver_unregister(&pruss_driver);
+	u8 sum = 0;
 
-	mutex_destroy(&pruchar_mutex);
+	while (len--)
+		sum += *data++;
 
-	device_destroy(prucharClass, MKDEV(majorNumber, 0));
-	class_unregister(prucharClass);
-	class_destroy(prucharClass);
-	unregister_chrdev(majorNumber, DEVICE_NAME);
-	printk(KERN_INFO "PRU KVM: module closed.\n");
+	return !sum;
 }
 
-/* Tries to acquire mutex and initializes the completion variable. Two or more
- * processes cannot open the file simultaneously */
-static int dev_open(struct inode *inodep, struct file *filep){
+/* Copies len bytes into the monitor ring at offset head. Must be called with mon_lock held. */
+static void dev_mon_put (u32 head, const void *src, u32 len) {
 
-	if(!mutex_trylock(&pruchar_mutex)){    /* Try to acquire the mutex */
-		/* returns 1 if successful and 0 if there is contention */
-		printk(KERN_ALERT "PRU KVM: Device in use by another process");
-		return -EBUSY;
+	u32 first = min_t(u32, len, mon_size - head);
+
+	memcpy(mon_buf + head, src, first);
+	memcpy(mon_buf, (const u8 *) src + first, len - first);
+}
+
+/* Appends an enhanced packet block with a frame seen on the bus. orig_len is
+ * the length announced on the bus, which is larger than len if the frame did
+ * not fit in the shared RAM. The whole block is dropped if there is no room. */
+static void dev_mon_frame (u32 flags, const u8 *data, u32 len, u32 orig_len, u64 ts) {
+
+	static const u8 zero[4];
+	struct pcapng_epb epb;
+	struct pcapng_epb_tail tail;
+	u32 pad = (4 - (len & 3)) & 3, total = sizeof(epb) + len + pad + sizeof(tail), head;
+	unsigned long irqflags;
+
+	if (!READ_ONCE(mon_active))
+		return;
+
+	epb.type = PCAPNG_EPB;
+	epb.total_len = total;
+	epb.interface = 0;
+	epb.ts_high = ts >> 32;
+	epb.ts_low = ts;
+	epb.cap_len = len;
+	epb.orig_len = max(orig_len, len);
+
+	tail.flags_code = PCAPNG_OPT_EPB_FLAGS;
+	tail.flags_len = sizeof(tail.flags);
+	tail.flags = flags;
+	tail.end_of_opt = 0;
+	tail.total_len = total;
+
+	spin_lock_irqsave(&mon_lock, irqflags);
+
+	/* The capture may have ended and its buffer be gone */
+	if (!mon_active) {
+		spin_unlock_irqrestore(&mon_lock, irqflags);
+		return;
 	}
 
-	init_completion(&intr_completion);
+	if (mon_size - (mon_head - mon_tail) < total) {
+		mon_drops++;
+		spin_unlock_irqrestore(&mon_lock, irqflags);
+		return;
+	}
 
-	printk(KERN_INFO "PRU KVM: device has been opened.\n");
-	return 0;
+	head = mon_head & (mon_size - 1);
+	dev_mon_put(head, &epb, sizeof(epb));
+	head = (head + sizeof(epb)) & (mon_size - 1);
+	dev_mon_put(head, data, len);
+	head = (head + len) & (mon_size - 1);
+	dev_mon_put(head, zero, pad);
+	head = (head + pad) & (mon_size - 1);
+	dev_mon_put(head, &tail, sizeof(tail));
+
+	smp_wmb();
+	mon_head += total;
+
+	spin_unlock_irqrestore(&mon_lock, irqflags);
+
+	wake_up_interruptible(&mon_wait);
 }
 
-/* Releases resources after a close() call */
-static int dev_release(struct inode *inodep, struct file *filep){
+/* Size of the bus monitor buffer, 0 if mon_pool_sz is out of range */
+static u32 dev_mon_region_size (void) {
 
-	mutex_unlock(&pruchar_mutex);
+	if (mon_pool_sz < SZ_4K || mon_pool_sz > SZ_4M)
+		return 0;
 
-	printk(KERN_INFO "PRU KVM: device successfully closed.\n");
-	return 0;
+	return rounddown_pow_of_two(mon_pool_sz);
 }
 
-/* Reads current shared memory state  */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
+/* Allocates the flight recorder. It is kept apart from the external ram
+ * pool, which user space and the PRU own entirely. Recording is simply off
+ * if it cannot be allocated. */
+static void dev_trace_init (void) {
 
-	int error_count = 0;
+	u32 entries;
 
-	if (_pdev) {
+	trace_buf = NULL;
+	trace_entries = 0;
 
-		struct uio_pruss_dev *gdev = platform_get_drvdata(_pdev);
+	if (trace_pool_sz < sizeof(struct pruss_trace_rec) * 2)
+		return;
 
-		if (gdev) {
+	entries = rounddown_pow_of_two(trace_pool_sz / sizeof(struct pruss_trace_rec));
+	trace_buf = vzalloc(entries * sizeof(struct pruss_trace_rec));
+	if (!trace_buf) {
+		printk(KERN_ALERT "PRU KVM: failed to allocate the flight recorder.\n");
+		return;
+	}
+
+	atomic_set(&trace_idx, 0);
+	smp_wmb();
+	trace_entries = entries;
+}
 
-			struct resource *_regs_prussio = platform_get_resource(_pdev, IORESOURCE_MEM, 0);
-			unsigned int _uio_size = resource_size(_regs_prussio), count = 0, i;
-			void __iomem *p = ioremap(_regs_prussio->start, _uio_size) + PRUSS_SHAREDRAM_BASE;
+/* Frees the flight recorder, once no frame can be recorded or dumped */
+static void dev_trace_cleanup (void) {
 
-			u8 mode = ioread8(p + MODE_OFFSET), status;
+	trace_entries = 0;
+	vfree(trace_buf);
+	trace_buf = NULL;
+}
 
-			printk(KERN_INFO "mode %c\n", mode);
+/* Overwrites the oldest flight recorder record */
+static void dev_trace_frame (u32 flags, const u8 *data, u32 len, u32 orig_len, u64 ts) {
 
-			switch (mode) {
-			case 'M':
-				while (ioread8(p + STATUS_OFFSET)); //REPLACE?
+	struct pruss_trace_rec *rec;
+	u32 idx, entries = READ_ONCE(trace_entries);
 
-				count = 0;
+	if (!entries)
+		return;
 
-				printk(KERN_INFO "OKKKK\n");
+	idx = atomic_inc_return(&trace_idx) - 1;
+	rec = &trace_buf[idx & (entries - 1)];
 
-				for (i = 0; i < 4; i++)
-					count += (ioread8(p + SHRAM_READ_OFFSET) << (i*8));
+	rec->seq = 0;
+	smp_wmb();
 
-				printk(KERN_INFO "65234523423\n");
+	rec->flags = flags;
+	rec->ts_ns = ts;
+	rec->len = min_t(u32, orig_len, 0xffff);
+	rec->cap_len = min_t(u32, len, TRACE_DATA_LEN);
+	memcpy(rec->data, data, rec->cap_len);
 
-				/*for (i = 0; i < count; i++)
-					message[i] = ioread8(p + SHRAM_READ_OFFSET + 4 + i);
-					*/
+	smp_wmb();
+	rec->seq = idx + 1;
+}
 
-				for (count = 0;	count < SRAM_SIZE;	count++) {
-					message[count] = ioread8(p + count);
-					if (count < 100) printk (KERN_INFO "[%d] = 0x%u\n", count, message[count]);
-				}
+/* Every frame seen on the bus goes through here: it is recorded by the
+ * flight recorder and, while a capture is running, by the bus monitor. */
+static void dev_tap_frame (u32 flags, const u8 *data, u32 len, u32 orig_len) {
 
-				break;
+	u64 ts = ktime_to_ns(ktime_get_real());
 
-			case 'S':
+	if (!dev_frame_checksum_ok(data, len))
+		flags |= MON_CHECKSUM_ERROR;
+	if (orig_len > len)
+		flags |= MON_TOO_LONG;
 
-				status = ioread8(p + STATUS_OFFSET);
-				if (status  == NEW_RECEIVED_MESSAGE){
+	dev_trace_frame(flags, data, len, orig_len, ts);
+	dev_mon_frame(flags, data, len, orig_len, ts);
+}
 
-					count = 0;
+/* Dumps the flight recorder records */
+static ssize_t dev_trace_read (struct file *filep, struct kobject *kobj, struct bin_attribute *attr,
+		char *buf, loff_t off, size_t count) {
 
-					for (i = 0; i < 4; i++)
-						count += (ioread8(p + SHRAM_READ_OFFSET) << (i*8));
+	size_t size = READ_ONCE(trace_entries) * sizeof(struct pruss_trace_rec);
 
-					for (i = 0; i < count; i++)
-						message[i] = ioread8(p + SHRAM_READ_OFFSET + 4 + i);
+	if (off >= size)
+		return 0;
 
-				}
-				else if (status == OLD_MESSAGE)
-					return -EINVAL;
+	count = min_t(size_t, count, size - off);
+	memcpy(buf, (u8 *) trace_buf + off, count);
 
-				break;
+	return count;
+}
+
+static struct bin_attribute dev_attr_trace = {
+		.attr = { .name = "trace", .mode = S_IRUSR },
+		.read = dev_trace_read,
+};
+
+/* Checks a destination address against the slave address filter. Must be called with rx_lock held. */
+static bool dev_addr_filter_match (u8 dst_addr) {
+
+	u8 i;
+
+	if (!(addr_filter.flags & ADDR_FILTER_ENABLE))
+		return true;
+
+	if ((addr_filter.flags & ADDR_FILTER_BROADCAST) && dst_addr == PRUSS_ADDR_BROADCAST)
+		return true;
+
+	if ((addr_filter.flags & ADDR_FILTER_OWN) && !((dst_addr ^ own_addr) & addr_filter.mask))
+		return true;
+
+	for (i = 0; i < addr_filter.n_extra; i++)
+		if (!((dst_addr ^ addr_filter.extra[i]) & addr_filter.mask))
+			return true;
+
+	return false;
+}
+
+/* Updates the slave address filter. Board address is taken from HW_ADDR_OFFSET,
+ * so PRUSS_GET_HW_ADDRESS should be issued first. */
+static int dev_set_addr_filter (void __iomem *io_vaddr, unsigned long arg) {
+
+	struct pruss_addr_filter filter;
+
+	if (copy_from_user(&filter, (void __user *) arg, sizeof(filter)))
+		return -EFAULT;
+
+	if (filter.n_extra > PRUSS_ADDR_FILTER_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&rx_lock);
+	addr_filter = filter;
+	own_addr = ioread8(io_vaddr + HW_ADDR_OFFSET);
+	spin_unlock_irq(&rx_lock);
+
+	return 0;
+}
+
+/* Validates a classic BPF program in the same way as sk_chk_filter(): known
+ * opcodes only, jumps must land inside the program, scratch memory accesses
+ * must be in range and the last instruction must be a return. */
+static int dev_bpf_check (const struct sock_filter *insns, u16 len) {
+
+	u16 pc;
 
-			default:
+	if (!len || len > BPF_MAXINSNS)
+		return -EINVAL;
+
+	for (pc = 0; pc < len; pc++) {
+
+		const struct sock_filter *f = &insns[pc];
+
+		switch (f->code) {
+
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+		case BPF_LD | BPF_W | BPF_LEN:
+		case BPF_LD | BPF_IMM:
+		case BPF_LDX | BPF_W | BPF_LEN:
+		case BPF_LDX | BPF_IMM:
+		case BPF_LDX | BPF_B | BPF_MSH:
+		case BPF_ALU | BPF_ADD | BPF_K:
+		case BPF_ALU | BPF_ADD | BPF_X:
+		case BPF_ALU | BPF_SUB | BPF_K:
+		case BPF_ALU | BPF_SUB | BPF_X:
+		case BPF_ALU | BPF_MUL | BPF_K:
+		case BPF_ALU | BPF_MUL | BPF_X:
+		case BPF_ALU | BPF_DIV | BPF_X:
+		case BPF_ALU | BPF_MOD | BPF_X:
+		case BPF_ALU | BPF_AND | BPF_K:
+		case BPF_ALU | BPF_AND | BPF_X:
+		case BPF_ALU | BPF_OR | BPF_K:
+		case BPF_ALU | BPF_OR | BPF_X:
+		case BPF_ALU | BPF_XOR | BPF_K:
+		case BPF_ALU | BPF_XOR | BPF_X:
+		case BPF_ALU | BPF_LSH | BPF_X:
+		case BPF_ALU | BPF_RSH | BPF_X:
+		case BPF_ALU | BPF_NEG:
+		case BPF_RET | BPF_K:
+		case BPF_RET | BPF_A:
+		case BPF_MISC | BPF_TAX:
+		case BPF_MISC | BPF_TXA:
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_K:
+		case BPF_ALU | BPF_MOD | BPF_K:
+			if (!f->k)
 				return -EINVAL;
-			}
+			break;
 
-			/* copy_to_user has the format ( * to, *from, size) and returns 0 on success */
-			if (copy_to_user(buffer, message, count)){
-				printk(KERN_INFO "PRU KVM: Failed to send %d characters to the user\n", error_count);
-				return -EFAULT;
-			}
+		/* As bpf_check_classic(): no shift by the register width or more */
+		case BPF_ALU | BPF_LSH | BPF_K:
+		case BPF_ALU | BPF_RSH | BPF_K:
+			if (f->k >= 32)
+				return -EINVAL;
+			break;
 
-			printk(KERN_INFO "PRU KVM: Sent %d characters to the user\n", count);
-			return 0;
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+			if (f->k >= BPF_MEMWORDS)
+				return -EINVAL;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			if (f->k >= (u32) (len - pc - 1))
+				return -EINVAL;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_K:
+		case BPF_JMP | BPF_JEQ | BPF_X:
+		case BPF_JMP | BPF_JGT | BPF_K:
+		case BPF_JMP | BPF_JGT | BPF_X:
+		case BPF_JMP | BPF_JGE | BPF_K:
+		case BPF_JMP | BPF_JGE | BPF_X:
+		case BPF_JMP | BPF_JSET | BPF_K:
+		case BPF_JMP | BPF_JSET | BPF_X:
+			if (pc + f->jt + 1 >= len || pc + f->jf + 1 >= len)
+				return -EINVAL;
+			break;
+
+		default:
+			return -EINVAL;
 		}
 	}
-	return -EINVAL;
+
+	return BPF_CLASS(insns[len - 1].code) == BPF_RET ? 0 : -EINVAL;
 }
 
-/* Writes into the shared memory area */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
+/* Loads size bytes (network byte order) from offset off of the frame */
+static bool dev_bpf_load (const u8 *data, u32 len, u32 off, u8 size, u32 *val) {
 
-	if (_pdev) {
+	u8 i;
 
-		struct uio_pruss_dev *gdev = platform_get_drvdata(_pdev);
+	if (off >= len || size > len - off)
+		return false;
 
-		if (gdev) {
+	for (*val = 0, i = 0; i < size; i++)
+		*val = (*val << 8) | data[off + i];
 
-			struct resource *_regs_prussio = platform_get_resource(_pdev, IORESOURCE_MEM, 0);
-			unsigned int _uio_size = resource_size(_regs_prussio), count;
-			void __iomem 	*base = ioremap(_regs_prussio->start, _uio_size),
-					*p =  base + PRUSS_SHAREDRAM_BASE,
-					*intrc = base + gdev->pintc_base;
+	return true;
+}
 
-			printk(KERN_INFO "EBBChar: Received %zu characters from the user\n", len);
+/* Runs a validated classic BPF program over a frame. Loads outside the frame
+ * drop it, as the socket filter does. */
+static u32 dev_bpf_run (const struct pruss_rx_prog *prog, const u8 *data, u32 len) {
 
-			if (ioread8(p + MODE_OFFSET) == 'M') {
-				//iowrite32(,p + TIMEOUT_OFFSET); TO-DO
-			}
+	u32 A = 0, X = 0, mem[BPF_MEMWORDS] = {0}, val;
+	const struct sock_filter *f = prog->insns;
 
-			/* SHRAM_WRITE_OFFSET is not 4-byte aligned, so we need to write
-			 * each byte at a time */
-			iowrite8(len & 0xff, p + SHRAM_WRITE_OFFSET);
-			iowrite8((len >> 8) & 0xff, p + SHRAM_WRITE_OFFSET + 1);
-			iowrite8((len >> 16) & 0xff, p + SHRAM_WRITE_OFFSET + 2);
-			iowrite8((len >> 24) & 0xff, p + SHRAM_WRITE_OFFSET + 3);
+	for (;; f++) {
 
-			for (count = 0; count < len; count++)
-				iowrite8(buffer[count], p + SHRAM_WRITE_OFFSET + 4 + count);
+		switch (f->code) {
 
-			iowrite8(MESSAGE_TO_SEND, p + STATUS_OFFSET);
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (!dev_bpf_load(data, len, f->k,
+					BPF_SIZE(f->code) == BPF_W ? 4 : BPF_SIZE(f->code) == BPF_H ? 2 : 1, &A))
+				return 0;
+			break;
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+			if (!dev_bpf_load(data, len, X + f->k,
+					BPF_SIZE(f->code) == BPF_W ? 4 : BPF_SIZE(f->code) == BPF_H ? 2 : 1, &A))
+				return 0;
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			A = len;
+			break;
+		case BPF_LD | BPF_IMM:
+			A = f->k;
+			break;
+		case BPF_LD | BPF_MEM:
+			A = mem[f->k];
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			X = len;
+			break;
+		case BPF_LDX | BPF_IMM:
+			X = f->k;
+			break;
+		case BPF_LDX | BPF_MEM:
+			X = mem[f->k];
+			break;
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (!dev_bpf_load(data, len, f->k, 1, &val))
+				return 0;
+			X = (val & 0xf) << 2;
+			break;
+		case BPF_ST:
+			mem[f->k] = A;
+			break;
+		case BPF_STX:
+			mem[f->k] = X;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_K:
+			A += f->k;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_X:
+			A += X;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_K:
+			A -= f->k;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_X:
+			A -= X;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_K:
+			A *= f->k;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_X:
+			A *= X;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_K:
+			A /= f->k;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (!X)
+				return 0;
+			A /= X;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_K:
+			A %= f->k;
+			break;
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (!X)
+				return 0;
+			A %= X;
+			break;
+		case BPF_ALU | BPF_AND | BPF_K:
+			A &= f->k;
+			break;
+		case BPF_ALU | BPF_AND | BPF_X:
+			A &= X;
+			break;
+		case BPF_ALU | BPF_OR | BPF_K:
+			A |= f->k;
+			break;
+		case BPF_ALU | BPF_OR | BPF_X:
+			A |= X;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_K:
+			A ^= f->k;
+			break;
+		case BPF_ALU | BPF_XOR | BPF_X:
+			A ^= X;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_K:
+			A <<= f->k;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_X:
+			A <<= X & 31;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_K:
+			A >>= f->k;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_X:
+			A >>= X & 31;
+			break;
+		case BPF_ALU | BPF_NEG:
+			A = -A;
+			break;
+		case BPF_JMP | BPF_JA:
+			f += f->k;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			f += (A == f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			f += (A == X) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_K:
+			f += (A > f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			f += (A > X) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_K:
+			f += (A >= f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_X:
+			f += (A >= X) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_K:
+			f += (A & f->k) ? f->jt : f->jf;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_X:
+			f += (A & X) ? f->jt : f->jf;
+			break;
+		case BPF_MISC | BPF_TAX:
+			X = A;
+			break;
+		case BPF_MISC | BPF_TXA:
+			A = X;
+			break;
+		case BPF_RET | BPF_K:
+			return f->k;
+		case BPF_RET | BPF_A:
+			return A;
+		default:
+			return 0;
+		}
+	}
+}
 
-			/* Waits for an interruption to finish the writing cycle. */
-			wait_for_completion(&intr_completion);
+/* Copies a classic BPF program from user space, validates it and replaces the
+ * one in slot, which is either the device program or a reader's one. A NULL
+ * argument only detaches it. */
+static int dev_attach_filter (struct pruss_rx_prog __rcu **slot, unsigned long arg) {
 
-			/* Clears system event */
-			iowrite32(1 << PRU_ARM_INTERRUPT, intrc + PRU_INTC_SECR1_REG);
+	struct pruss_rx_prog *prog = NULL, *old;
+	struct sock_fprog fprog;
 
-			/* Re-enables interruption */
-			iowrite32(1 << PRU_EVTOUT, intrc + PINTC_HIEISR);
+	if (arg) {
 
-			if (ioread8(p + MODE_OFFSET) == 'M')
-				while (ioread8(p + STATUS_OFFSET) != OLD_MESSAGE); /* REPLACE? */
+		int err;
 
-			return len;
+		if (copy_from_user(&fprog, (void __user *) arg, sizeof(fprog)))
+			return -EFAULT;
 
-		}
-		else {
-			printk (KERN_INFO "gdev NULL \n");
+		if (!fprog.len || fprog.len > BPF_MAXINSNS)
+			return -EINVAL;
+
+		prog = kmalloc(sizeof(*prog) + fprog.len * sizeof(struct sock_filter), GFP_KERNEL);
+		if (!prog)
+			return -ENOMEM;
+
+		prog->len = fprog.len;
+		if (copy_from_user(prog->insns, fprog.filter, fprog.len * sizeof(struct sock_filter))) {
+			kfree(prog);
 			return -EFAULT;
 		}
+
+		err = dev_bpf_check(prog->insns, prog->len);
+		if (err) {
+			kfree(prog);
+			return err;
+		}
 	}
 
-	return -EINVAL;
+	spin_lock_irq(&rx_lock);
+	old = rcu_dereference_protected(*slot, lockdep_is_held(&rx_lock));
+	rcu_assign_pointer(*slot, prog);
+	spin_unlock_irq(&rx_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
 }
 
-/* ioctl() commands handler */
-static long dev_unlocked_ioctl (struct file *filep, unsigned int cmd, unsigned long arg) {
+/* Adds an entry to the slave reply cache and returns its index */
+static int dev_add_reply (unsigned long arg) {
 
-	if (_pdev) {
+	struct pruss_reply *reply;
+	int idx;
 
-		u8 hw_addr;
-		struct uio_pruss_dev *gdev = platform_get_drvdata(_pdev);
+	reply = kmalloc(sizeof(*reply), GFP_KERNEL);
+	if (!reply)
+		return -ENOMEM;
 
-		if (gdev) {
+	if (copy_from_user(reply, (void __user *) arg, sizeof(*reply))) {
+		kfree(reply);
+		return -EFAULT;
+	}
 
-			struct resource *_regs_prussio = platform_get_resource(_pdev, IORESOURCE_MEM, 0);
-			unsigned int _uio_size = resource_size(_regs_prussio);
-			void __iomem *p = ioremap(_regs_prussio->start, _uio_size) + PRUSS_SHAREDRAM_BASE;
+	if (!reply->req_len || reply->req_len > REPLY_REQ_MAX ||
+			!reply->resp_len || reply->resp_len > REPLY_RESP_MAX) {
+		kfree(reply);
+		return -EINVAL;
+	}
 
-			switch (cmd) {
+	spin_lock_irq(&rx_lock);
+	idx = ffs(~reply_valid & ((1 << REPLY_CACHE_SZ) - 1)) - 1;
+	if (idx >= 0) {
+		reply_cache[idx] = *reply;
+		reply_valid |= 1 << idx;
+	}
+	spin_unlock_irq(&rx_lock);
 
-			case PRUSS_MODE:
+	kfree(reply);
 
-				if (arg == 'M' || arg == 'S') {
-					iowrite8(arg, p + MODE_OFFSET);
+	return idx >= 0 ? idx : -ENOSPC;
+}
 
-					dev_set_sync_stop(p);
+/* Removes an entry from the slave reply cache or all of them if idx is negative */
+static int dev_del_reply (long idx) {
 
-					if (arg == 'S')
-						iowrite8(OLD_MESSAGE, p + STATUS_OFFSET);
+	if (idx >= REPLY_CACHE_SZ)
+		return -EINVAL;
 
-					return 0;
-				}
-				return -EINVAL;
+	spin_lock_irq(&rx_lock);
+	reply_valid &= idx < 0 ? 0 : ~(1 << idx);
+	spin_unlock_irq(&rx_lock);
 
-			case PRUSS_BAUDRATE:
+	return 0;
+}
 
-				return dev_config_baudrate(p, arg);
+/* Looks a received frame up in the slave reply cache. Must be called with rx_lock held. */
+static const struct pruss_reply *dev_reply_lookup (const u8 *data, u32 len) {
 
-			case PRUSS_CLEAN:
+	u16 valid = reply_valid;
 
-				return dev_clean_sram(p);
+	while (valid) {
 
-			case PRUSS_GET_HW_ADDRESS:
+		int idx = ffs(valid) - 1;
+		const struct pruss_reply *reply = &reply_cache[idx];
+		u16 i;
 
-				hw_addr = dev_get_hw_addr();
-				iowrite8(hw_addr, p + HW_ADDR_OFFSET);
+		valid &= ~(1 << idx);
 
-				return 0;
+		if (reply->req_len != len)
+			continue;
 
-			case PRUSS_TIMEOUT:
+		for (i = 0; i < len; i++)
+			if ((data[i] ^ reply->req[i]) & reply->mask[i])
+				break;
 
-				arg = arg * 66600;
+		if (i == len)
+			return reply;
+	}
 
-				iowrite8(arg & 0xff, p + TIMEOUT_OFFSET);
-				iowrite8((arg > 8) & 0xff, p + TIMEOUT_OFFSET + 1);
-				iowrite8((arg > 16) & 0xff, p + TIMEOUT_OFFSET + 2);
-				iowrite8((arg > 24) & 0xff, p + TIMEOUT_OFFSET + 3);
+	return NULL;
+}
 
-				return 0;
+/* Configures the register table. n_vars = 0 disables it. */
+static int dev_set_regmap (unsigned long arg) {
 
-			case PRUSS_SET_SYNC_STEP:
+	struct pruss_regmap *map;
+	u8 i;
 
-				return dev_set_sync_step(p);
+	map = kmalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
 
-			case PRUSS_SET_PULSE_COUNT_SYNC:
+	if (copy_from_user(map, (void __user *) arg, sizeof(*map))) {
+		kfree(map);
+		return -EFAULT;
+	}
 
-				return dev_set_sync_counter(p, arg);
+	for (i = 0; i < map->n_vars && i < REGMAP_VARS_MAX; i++)
+		if (!map->vars[i].size || map->vars[i].size > REGMAP_VAR_SIZE_MAX ||
+				map->vars[i].offset + map->vars[i].size > PAGE_SIZE - REGMAP_SEQ_SIZE)
+			break;
 
-			case PRUSS_GET_PULSE_COUNT_SYNC:
+	if (i != map->n_vars) {
+		kfree(map);
+		return -EINVAL;
+	}
 
-				return ioread16(p + COUNTER_OFFSET);
+	mutex_lock(&pruchar_mutex);
+	if (!regmap_page)
+		regmap_page = (u8 *) get_zeroed_page(GFP_KERNEL);
+	mutex_unlock(&pruchar_mutex);
 
-			case PRUSS_CLEAR_PULSE_COUNT_SYNC:
+	if (!regmap_page) {
+		kfree(map);
+		return -ENOMEM;
+	}
 
-				return dev_clear_count_sync(p);
+	spin_lock_irq(&rx_lock);
+	regmap = *map;
+	bitmap_zero(regmap_changed, REGMAP_VARS_MAX);
+	spin_unlock_irq(&rx_lock);
 
-			case PRUSS_START_SYNC:
+	kfree(map);
 
-				return dev_set_sync_start(arg, p);
+	return 0;
+}
 
-			case PRUSS_STOP_SYNC:
+/* Builds an answer to the master in regmap_resp and returns its length */
+static u32 dev_regmap_answer (u8 cmd, const u8 *payload, u16 size) {
+
+	u16 i;
+	u8 sum = 0;
+
+	regmap_resp[0] = regmap.master_addr;
+	regmap_resp[1] = cmd;
+	regmap_resp[2] = size >> 8;
+	regmap_resp[3] = size & 0xff;
+	memcpy(regmap_resp + 4, payload, size);
+
+	for (i = 0; i < size + 4; i++)
+		sum += regmap_resp[i];
+	regmap_resp[size + 4] = -sum;
+
+	return size + 5;
+}
+
+/* Sequence counter of the register table, at the end of its page */
+static u32 *dev_regmap_seq (void) {
+
+	return (u32 *) (regmap_page + PAGE_SIZE - REGMAP_SEQ_SIZE);
+}
+
+/* Serves read and write variable requests addressed to this node from the
+ * register table. Returns the length of the answer in regmap_resp, or 0 if
+ * the request must be handed to user space. Must be called with rx_lock held. */
+static u32 dev_regmap_serve (const u8 *data, u32 len) {
+
+	const struct pruss_regmap_var *var;
+	u32 *seq = dev_regmap_seq();
+	u32 start, ret;
+	u16 size;
+
+	if (!regmap.n_vars || len < 6 || data[0] != own_addr || !dev_frame_checksum_ok(data, len))
+		return 0;
+
+	size = (data[2] << 8) | data[3];
+	if (len != size + 5u)
+		return 0;
+
+	start = READ_ONCE(*seq);
+
+	switch (data[1]) {
+
+	case BSMP_READ_VAR:
+
+		if (size != 1)
+			return dev_regmap_answer(BSMP_ERR_INVALID_SIZE, NULL, 0);
+		if (data[4] >= regmap.n_vars)
+			return dev_regmap_answer(BSMP_ERR_INVALID_ID, NULL, 0);
+
+		/* User space may be updating the variable: it answers itself if
+		 * the copy could be torn */
+		if (start & 1)
+			return 0;
+		smp_rmb();
+
+		var = &regmap.vars[data[4]];
+		ret = dev_regmap_answer(BSMP_READ_VAR_ANSWER, regmap_page + var->offset, var->size);
+
+		smp_rmb();
+		return READ_ONCE(*seq) == start ? ret : 0;
+
+	case BSMP_WRITE_VAR:
+
+		if (data[4] >= regmap.n_vars)
+			return dev_regmap_answer(BSMP_ERR_INVALID_ID, NULL, 0);
+
+		var = &regmap.vars[data[4]];
+		if (!(var->flags & REGMAP_WRITABLE))
+			return dev_regmap_answer(BSMP_ERR_READ_ONLY, NULL, 0);
+		if (size != var->size + 1)
+			return dev_regmap_answer(BSMP_ERR_INVALID_SIZE, NULL, 0);
+
+		/* Same for a write while user space is updating variables */
+		if ((start & 1) || cmpxchg(seq, start, start + 1) != start)
+			return 0;
+
+		memcpy(regmap_page + var->offset, data + 5, var->size);
+		smp_store_release(seq, start + 2);
+
+		if (var->flags & REGMAP_NOTIFY) {
+			set_bit(data[4], regmap_changed);
+			wake_up_interruptible(&regmap_wait);
+		}
+
+		return dev_regmap_answer(BSMP_OK, NULL, 0);
+	}
+
+	return 0;
+}
+
+/* Waits for variables flagged REGMAP_NOTIFY to be written by the master and
+ * copies the bitmap of the changed ones, which is then cleared. */
+static int dev_regmap_wait (struct file *filep, unsigned long arg) {
+
+	DECLARE_BITMAP(changed, REGMAP_VARS_MAX);
+
+	if (filep->f_flags & O_NONBLOCK) {
+		if (bitmap_empty(regmap_changed, REGMAP_VARS_MAX))
+			return -EAGAIN;
+	}
+	else if (wait_event_interruptible(regmap_wait, !bitmap_empty(regmap_changed, REGMAP_VARS_MAX)))
+		return -ERESTARTSYS;
+
+	spin_lock_irq(&rx_lock);
+	bitmap_copy(changed, regmap_changed, REGMAP_VARS_MAX);
+	bitmap_zero(regmap_changed, REGMAP_VARS_MAX);
+	spin_unlock_irq(&rx_lock);
+
+	return copy_to_user((void __user *) arg, changed, sizeof(changed)) ? -EFAULT : 0;
+}
+
+/* Shared RAM as mapped by pruss_probe() */
+static void __iomem *dev_shram (void) {
+
+	struct uio_pruss_dev *gdev = _pdev ? platform_get_drvdata(_pdev) : NULL;
+
+	return gdev ? gdev->prussio_vaddr + PRUSS_SHAREDRAM_BASE : NULL;
+}
+
+/* Length of one byte on the wire, as configured by dev_config_baudrate() */
+static u32 dev_byte_ns (void __iomem *io_vaddr) {
+
+	u32 byte_ns = 0;
+	u8 i;
+
+	for (i = 0; i < 3; i++)
+		byte_ns |= ioread8(io_vaddr + BAUD_LENGTH_OFFSET + i) << (i * 8);
+
+	return byte_ns ? byte_ns : 1000;
+}
+
+/* Longest time a transaction can keep the bus: both frames and the answer
+ * timeout */
+static u64 dev_xfer_span_ns (void __iomem *p, struct pruss_xfer *xfer) {
+
+	return (xfer->req_len + xfer->resp_max) * (u64) dev_byte_ns(p) + timeout_ms * NSEC_PER_MSEC;
+}
+
+/* Rings the doorbell of the loaded transaction. The PRU sends the request and
+ * stores the answer at SHRAM_READ_OFFSET, setting STATUS to
+ * NEW_RECEIVED_MESSAGE. The deadline covers the whole transaction span,
+ * with some margin. Must be called with xfer_lock held. */
+static void dev_xfer_launch_locked (void __iomem *p, struct pruss_xfer *xfer) {
+
+	u64 byte_ns = dev_byte_ns(p);
+
+	xfer_launching = false;
+	xfer->t_start = ktime_get();
+
+	iowrite8(MESSAGE_TO_SEND, p + STATUS_OFFSET);
+
+	dev_tap_frame(MON_OUTBOUND, xfer->req, xfer->req_len, xfer->req_len);
+
+	xfer_deadline = ktime_add_ns(xfer->t_start, dev_xfer_span_ns(p, xfer) + NSEC_PER_MSEC);
+
+	/* First look at STATUS once the request is on the wire */
+	hrtimer_start(&xfer_timer, ktime_add_ns(xfer->t_start, xfer->req_len * byte_ns), HRTIMER_MODE_ABS);
+}
+
+/* Part of each sync cycle, from the pulse, left to the other frames: after
+ * the sync command and the delay programmed after it, until a byte before
+ * the next pulse. Must be called with sync_lock held. */
+static void dev_sync_window_locked (void __iomem *p, u64 *begin_ns, u64 *end_ns) {
+
+	u64 byte_ns = dev_byte_ns(p);
+
+	*begin_ns = sync_steps[sync_step_cur][0] * byte_ns + sync_delay.achieved_ns;
+	*end_ns = sync_period_ns > byte_ns ? sync_period_ns - byte_ns : 0;
+}
+
+/* Allowed interval i of a cycle, from its start: our TDMA slot i (or the whole
+ * cycle without TDMA), within the sync window while sync runs. Returns false
+ * if the slot is not ours. Must be called with xfer_lock held. */
+static bool dev_bus_interval (u8 i, bool sync_on, u64 w_begin, u64 w_end, u64 *begin, u64 *end) {
+
+	*begin = 0;
+	*end = U64_MAX;
+
+	if (tdma.n_slots) {
+
+		if (tdma.slots[i].node != tdma.node)
+			return false;
+
+		*begin = (u64) tdma.slots[i].offset_us * NSEC_PER_USEC;
+		*end = *begin + (u64) tdma.slots[i].length_us * NSEC_PER_USEC;
+	}
+
+	if (sync_on) {
+		*begin = max(*begin, w_begin);
+		*end = min(*end, w_end);
+	}
+
+	return *begin < *end;
+}
+
+/* Earliest time, from now on, at which a transaction lasting span_ns fits in
+ * one of our TDMA slots and, while sync runs, between the sync commands.
+ * Intervals are placed from the last sync pulse, in its cycle or in the next
+ * one. KTIME_MAX means waiting for the next pulse: TDMA is set while the
+ * period is not known yet or pulses stopped. Must be called with xfer_lock
+ * held. */
+static ktime_t dev_bus_gate (void __iomem *p, ktime_t now, u64 span_ns) {
+
+	ktime_t pulse, start, best = KTIME_MAX;
+	u64 period, cycles, w_begin = 0, w_end = 0, b, e;
+	unsigned long flags;
+	bool sync_on;
+	u8 i, c;
+
+	/* The sync window only applies once a period was measured: without
+	 * pulse interruptions, frames are sent right away as before */
+	spin_lock_irqsave(&sync_lock, flags);
+	pulse = sync_last;
+	period = sync_period_ns;
+	sync_on = (sync_state & PRUSS_SYNC_RUNNING) && period;
+	if (sync_on)
+		dev_sync_window_locked(p, &w_begin, &w_end);
+	spin_unlock_irqrestore(&sync_lock, flags);
+
+	if (!tdma.n_slots && !sync_on)
+		return now;
+
+	if (!period || ktime_before(now, pulse))
+		return KTIME_MAX;
+
+	/* Extrapolates at most one missed pulse. If pulses stopped, only a TDMA
+	 * schedule keeps frames waiting. */
+	cycles = div64_u64(ktime_to_ns(ktime_sub(now, pulse)), period);
+	if (cycles > 1)
+		return tdma.n_slots ? KTIME_MAX : now;
+
+	start = ktime_add_ns(pulse, cycles * period);
+
+	for (c = 0; c < 2; c++, start = ktime_add_ns(start, period)) {
+
+		for (i = 0; i < max_t(u8, tdma.n_slots, 1); i++) {
+
+			ktime_t begin, end;
+
+			if (!dev_bus_interval(i, sync_on, w_begin, w_end, &b, &e))
+				continue;
+
+			begin = ktime_add_ns(start, b);
+			end = e == U64_MAX ? KTIME_MAX : ktime_add_ns(start, e);
+
+			if (ktime_before(begin, now))
+				begin = now;
+
+			if (!ktime_after(ktime_add_ns(begin, span_ns), end) && ktime_before(begin, best))
+				best = begin;
+		}
+
+		if (best != KTIME_MAX)
+			break;
+	}
+
+	return best;
+}
+
+static int dev_get_sync_window (unsigned long arg) {
+
+	void __iomem *p = dev_shram();
+	struct pruss_sync_window window;
+
+	if (!p)
+		return -EINVAL;
+
+	spin_lock_irq(&sync_lock);
+	if (!(sync_state & PRUSS_SYNC_RUNNING) || !sync_period_ns) {
+		spin_unlock_irq(&sync_lock);
+		return -EAGAIN;
+	}
+	window.period_ns = sync_period_ns;
+	dev_sync_window_locked(p, &window.begin_ns, &window.end_ns);
+	spin_unlock_irq(&sync_lock);
+
+	return copy_to_user((void __user *) arg, &window, sizeof(window)) ? -EFAULT : 0;
+}
+
+/* Longest interval of a cycle a transaction can use, U64_MAX if unknown or
+ * unbounded. Must be called with xfer_lock held. */
+static u64 dev_bus_window_max (void __iomem *p) {
+
+	u64 w_begin = 0, w_end = 0, b, e, longest = 0;
+	unsigned long flags;
+	bool sync_on;
+	u8 i;
+
+	spin_lock_irqsave(&sync_lock, flags);
+	sync_on = (sync_state & PRUSS_SYNC_RUNNING) && sync_period_ns;
+	if (sync_on)
+		dev_sync_window_locked(p, &w_begin, &w_end);
+	spin_unlock_irqrestore(&sync_lock, flags);
+
+	if (!tdma.n_slots && !sync_on)
+		return U64_MAX;
+
+	for (i = 0; i < max_t(u8, tdma.n_slots, 1); i++)
+		if (dev_bus_interval(i, sync_on, w_begin, w_end, &b, &e))
+			longest = max(longest, e - b);
+
+	return longest;
+}
+
+/* Rings the doorbell of the active transaction if its launch time, TDMA slot
+ * and the sync commands allow it. Otherwise, its frame stays in shared RAM and dev_xfer_timer()
+ * tries again at the right time, or dev_sync_irq() at the next pulse. Must be
+ * called with xfer_lock held. */
+static void dev_xfer_launch_or_wait_locked (void __iomem *p, struct pruss_xfer *xfer) {
+
+	ktime_t now = ktime_get();
+	ktime_t gate;
+
+	/* A cancelled transaction is never sent */
+	if (xfer_abort) {
+		xfer_launching = false;
+		hrtimer_start(&xfer_timer, now, HRTIMER_MODE_ABS);
+		return;
+	}
+
+	gate = dev_bus_gate(p, now, dev_xfer_span_ns(p, xfer));
+
+	if (xfer->t_launch && ktime_after(xfer->t_launch, gate))
+		gate = xfer->t_launch;
+
+	if (!ktime_after(gate, now)) {
+		dev_xfer_launch_locked(p, xfer);
+		return;
+	}
+
+	xfer_launching = true;
+	xfer_deadline = KTIME_MAX;
+
+	if (gate != KTIME_MAX)
+		hrtimer_start(&xfer_timer, gate, HRTIMER_MODE_ABS);
+}
+
+/* Places a transaction waiting for its launch time or window again, once the
+ * pulse timing changed */
+static void dev_xfer_replace (void __iomem *p) {
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&xfer_lock, flags);
+	if (xfer_launching && hrtimer_try_to_cancel(&xfer_timer) >= 0)
+		dev_xfer_launch_or_wait_locked(p, xfer_active);
+	spin_unlock_irqrestore(&xfer_lock, flags);
+}
+
+/* Queues a transaction in its flow, at the tail, or at the head when it is
+ * put back. Must be called with xfer_lock held. */
+static void dev_xfer_enqueue_locked (struct pruss_xfer *xfer, bool head) {
+
+	struct pruss_flow *flow = xfer->flow;
+	u8 prio = xfer->prio;
+
+	if (head)
+		list_add(&xfer->node, &flow->queue[prio]);
+	else
+		list_add_tail(&xfer->node, &flow->queue[prio]);
+	flow->stats.queued++;
+
+	/* A flow which was idle waits for its turn with a fresh deficit */
+	if (list_empty(&flow->node[prio])) {
+		flow->deficit[prio] = 0;
+		if (head)
+			list_add(&flow->node[prio], &xfer_flows[prio]);
+		else
+			list_add_tail(&flow->node[prio], &xfer_flows[prio]);
+	}
+}
+
+/* Removes a queued transaction from its flow. Must be called with xfer_lock
+ * held. */
+static void dev_xfer_dequeue_locked (struct pruss_xfer *xfer) {
+
+	struct pruss_flow *flow = xfer->flow;
+
+	list_del(&xfer->node);
+	flow->stats.queued--;
+
+	if (list_empty(&flow->queue[xfer->prio]))
+		list_del_init(&flow->node[xfer->prio]);
+}
+
+/* Charges a finished transaction to its flow, whose turn passes once its
+ * deficit is spent. Must be called with xfer_lock held. */
+static void dev_xfer_account_locked (struct pruss_xfer *xfer) {
+
+	struct pruss_flow *flow = xfer->flow;
+	struct pruss_client_stats *stats = &flow->stats;
+	u8 prio = xfer->prio;
+	u64 queue_ns;
+
+	stats->xfers++;
+	stats->tx_bytes += xfer->req_len;
+	stats->rx_bytes += xfer->resp_len;
+
+	/* Not launched if cancelled meanwhile */
+	if (xfer->t_start) {
+		queue_ns = ktime_to_ns(ktime_sub(xfer->t_start, xfer->t_submit));
+		stats->queue_ns += queue_ns;
+		stats->queue_max_ns = max(stats->queue_max_ns, queue_ns);
+		stats->bus_ns += ktime_to_ns(ktime_sub(xfer->t_done, xfer->t_start));
+	}
+
+	flow->deficit[prio] -= xfer->req_len + xfer->resp_len;
+	if (flow->deficit[prio] <= 0 && !list_empty(&flow->node[prio]))
+		list_move_tail(&flow->node[prio], &xfer_flows[prio]);
+}
+
+/* Loads the next transaction of the most urgent class, if any, from the flow
+ * whose turn it is, and rings the doorbell, right away or at its launch time.
+ * Must be called with xfer_lock held. */
+static void dev_xfer_start_locked (void __iomem *p) {
+
+	struct pruss_flow *flow;
+	struct pruss_xfer *xfer;
+	u8 prio;
+
+	if (xfer_active || xfer_quiet)
+		return;
+
+	for (prio = 0; prio < PRUSS_PRIO_NR && list_empty(&xfer_flows[prio]); prio++)
+		;
+	if (prio == PRUSS_PRIO_NR)
+		return;
+
+	/* A flow starting its turn gets its quantum. Deficits are at most one
+	 * transaction in debt, so this loop is bounded. */
+	for (;;) {
+		flow = list_first_entry(&xfer_flows[prio], struct pruss_flow, node[prio]);
+		if (flow->deficit[prio] > 0)
+			break;
+
+		flow->deficit[prio] += flow->weight * XFER_QUANTUM;
+		if (flow->deficit[prio] > 0)
+			break;
+
+		list_move_tail(&flow->node[prio], &xfer_flows[prio]);
+	}
+
+	xfer = list_first_entry(&flow->queue[prio], struct pruss_xfer, node);
+	dev_xfer_dequeue_locked(xfer);
+	xfer_active = xfer;
+	xfer_abort = false;
+
+	dev_load_tx(p, xfer->req, xfer->req_len);
+	dev_xfer_launch_or_wait_locked(p, xfer);
+}
+
+/* Checks whether the active transaction is over. Returns it if so, after
+ * starting the next one. Must be called with xfer_lock held. */
+static struct pruss_xfer *dev_xfer_check_locked (void __iomem *p) {
+
+	struct pruss_xfer *xfer = xfer_active;
+	ktime_t now = ktime_get();
+	u32 count;
+
+	if (!xfer || xfer_launching)
+		return NULL;
+
+	if (xfer_abort) {
+
+		xfer->resp_len = 0;
+		xfer->status = -ECANCELED;
+	}
+	else if (ioread8(p + STATUS_OFFSET) == NEW_RECEIVED_MESSAGE) {
+
+		count = dev_rx_length(p);
+		xfer->resp_len = min(count, xfer->resp_max);
+		memcpy_fromio(xfer->resp, p + SHRAM_READ_OFFSET + 4, xfer->resp_len);
+		xfer->status = count ? 0 : -ETIMEDOUT;
+
+		if (count)
+			dev_tap_frame(MON_INBOUND, xfer->resp, xfer->resp_len, dev_rx_length_raw(p));
+	}
+	else if (ktime_after(now, xfer_deadline)) {
+
+		xfer->resp_len = 0;
+		xfer->status = -ETIMEDOUT;
+	}
+	else
+		return NULL;
+
+	iowrite8(OLD_MESSAGE, p + STATUS_OFFSET);
+
+	xfer->t_done = now;
+	dev_xfer_account_locked(xfer);
+	xfer_active = NULL;
+
+	/* The PRU may still be sending the request or receiving the answer of
+	 * an abandoned exchange: the next frame waits for its span to be over */
+	if (xfer_abort && xfer->t_start && ktime_before(now, xfer_deadline)) {
+		xfer_quiet = true;
+		hrtimer_start(&xfer_timer, xfer_deadline, HRTIMER_MODE_ABS);
+	}
+	else
+		dev_xfer_start_locked(p);
+
+	return xfer;
+}
+
+/* Ends a transaction: wakes anybody waiting for the engine to go idle and
+ * calls the completion callback. Called without xfer_lock held. */
+static void dev_xfer_finish (struct pruss_xfer *xfer) {
+
+	wake_up_all(&xfer_idle);
+
+	if (xfer->done)
+		xfer->done(xfer);
+}
+
+/* Polls STATUS while a transaction is active */
+static enum hrtimer_restart dev_xfer_timer (struct hrtimer *timer) {
+
+	void __iomem *p = dev_shram();
+	struct pruss_xfer *xfer;
+	unsigned long flags;
+	bool active;
+
+	if (!p)
+		return HRTIMER_NORESTART;
+
+	spin_lock_irqsave(&xfer_lock, flags);
+
+	/* End of the span of an abandoned exchange */
+	if (xfer_quiet) {
+		if (!ktime_before(ktime_get(), xfer_deadline)) {
+			xfer_quiet = false;
+			iowrite8(OLD_MESSAGE, p + STATUS_OFFSET);
+			dev_xfer_start_locked(p);
+		}
+		spin_unlock_irqrestore(&xfer_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	/* Launch time or slot of the loaded transaction */
+	if (xfer_launching) {
+		dev_xfer_launch_or_wait_locked(p, xfer_active);
+		spin_unlock_irqrestore(&xfer_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	xfer = dev_xfer_check_locked(p);
+	active = xfer_active && !xfer;
+	spin_unlock_irqrestore(&xfer_lock, flags);
+
+	if (xfer)
+		dev_xfer_finish(xfer);
+
+	/* A new transaction armed the timer itself */
+	if (!active)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(max_t(u32, 4 * dev_byte_ns(p), 20 * NSEC_PER_USEC)));
+	return HRTIMER_RESTART;
+}
+
+/* Interruption during a transaction: the request was sent or the answer
+ * arrived, so checks right away instead of waiting for the timer. */
+static void dev_xfer_irq (void __iomem *p) {
+
+	struct pruss_xfer *xfer;
+
+	spin_lock(&xfer_lock);
+	xfer = dev_xfer_check_locked(p);
+	spin_unlock(&xfer_lock);
+
+	if (xfer)
+		dev_xfer_finish(xfer);
+}
+
+/* Queues a transaction. The node must be set as master. */
+static int dev_xfer_submit (struct pruss_xfer *xfer) {
+
+	void __iomem *p = dev_shram();
+	unsigned long flags;
+
+	if (!p || ioread8(p + MODE_OFFSET) != 'M')
+		return -EINVAL;
+
+	if (!xfer->req_len || xfer->req_len > TX_FRAME_MAX)
+		return -EINVAL;
+
+	xfer->status = -EINPROGRESS;
+	xfer->resp_len = 0;
+	xfer->t_submit = ktime_get();
+	xfer->t_start = 0;
+
+	if ((xfer->flags & PRUSS_TXTIME_DROP_LATE) && xfer->t_launch &&
+			ktime_after(xfer->t_submit, ktime_add_ns(xfer->t_launch, TXTIME_LATE_NS)))
+		return -ETIME;
+
+	spin_lock_irqsave(&xfer_lock, flags);
+
+	/* It would wait forever for a window long enough */
+	if (dev_xfer_span_ns(p, xfer) > dev_bus_window_max(p)) {
+		spin_unlock_irqrestore(&xfer_lock, flags);
+		return -EMSGSIZE;
+	}
+
+	dev_xfer_enqueue_locked(xfer, false);
+
+	/* A less urgent frame waiting for its launch time or window is
+	 * unloaded, back at the head of its queue */
+	if (xfer_launching && xfer->prio < xfer_active->prio && hrtimer_try_to_cancel(&xfer_timer) >= 0) {
+		dev_xfer_enqueue_locked(xfer_active, true);
+		xfer_active = NULL;
+		xfer_launching = false;
+	}
+
+	dev_xfer_start_locked(p);
+	spin_unlock_irqrestore(&xfer_lock, flags);
+
+	return 0;
+}
+
+/* Whether owner (anybody if NULL) has no transaction running anymore */
+static bool dev_xfer_owner_idle (void *owner) {
+
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&xfer_lock, flags);
+	idle = !xfer_active || (owner && xfer_active->owner != owner);
+	spin_unlock_irqrestore(&xfer_lock, flags);
+
+	return idle;
+}
+
+/* Cancels a transaction which is not over. A queued one, or the active one
+ * while it waits for its launch time, is moved to cancelled, for the caller to
+ * finish. Once on the wire, it is abandoned: xfer_timer ends it, and the next
+ * frame is only loaded once its span is over, with STATUS set back to
+ * OLD_MESSAGE. Must be called with xfer_lock held. */
+static void dev_xfer_cancel_locked (struct pruss_xfer *xfer, struct list_head *cancelled) {
+
+	if (xfer->status != -EINPROGRESS)
+		return;
+
+	if (xfer != xfer_active) {
+		dev_xfer_dequeue_locked(xfer);
+		list_add_tail(&xfer->node, cancelled);
+		xfer->status = -ECANCELED;
+		return;
+	}
+
+	/* Not sent yet, unless the timer is launching it right now */
+	if (xfer_launching && hrtimer_try_to_cancel(&xfer_timer) >= 0) {
+		list_add_tail(&xfer->node, cancelled);
+		xfer->status = -ECANCELED;
+		xfer_active = NULL;
+		xfer_launching = false;
+		dev_xfer_start_locked(dev_shram());
+		return;
+	}
+
+	xfer_abort = true;
+}
+
+/* Finishes the transactions cancelled by dev_xfer_cancel_locked() */
+static void dev_xfer_finish_cancelled (struct list_head *cancelled) {
+
+	struct pruss_xfer *xfer, *tmp;
+
+	list_for_each_entry_safe(xfer, tmp, cancelled, node) {
+		list_del(&xfer->node);
+		xfer->t_done = ktime_get();
+		dev_xfer_finish(xfer);
+	}
+}
+
+/* Cancels one transaction, if not over yet */
+static void dev_xfer_cancel (struct pruss_xfer *xfer) {
+
+	LIST_HEAD(cancelled);
+
+	spin_lock_irq(&xfer_lock);
+	dev_xfer_cancel_locked(xfer, &cancelled);
+	spin_unlock_irq(&xfer_lock);
+
+	dev_xfer_finish_cancelled(&cancelled);
+}
+
+/* Cancels every transaction of owner, or of anybody if NULL, without waiting
+ * for the one on the wire to be abandoned */
+static void dev_xfer_cancel_owner (void *owner) {
+
+	struct pruss_flow *flow, *next;
+	struct pruss_xfer *xfer, *tmp;
+	LIST_HEAD(cancelled);
+	u8 prio;
+
+	spin_lock_irq(&xfer_lock);
+	for (prio = 0; prio < PRUSS_PRIO_NR; prio++)
+		list_for_each_entry_safe(flow, next, &xfer_flows[prio], node[prio])
+			list_for_each_entry_safe(xfer, tmp, &flow->queue[prio], node)
+				if (!owner || xfer->owner == owner)
+					dev_xfer_cancel_locked(xfer, &cancelled);
+
+	if (xfer_active && (!owner || xfer_active->owner == owner))
+		dev_xfer_cancel_locked(xfer_active, &cancelled);
+	spin_unlock_irq(&xfer_lock);
+
+	dev_xfer_finish_cancelled(&cancelled);
+}
+
+/* Cancels the transactions of owner, completing them with -ECANCELED, and
+ * waits for its active one, if any, to be over */
+static void dev_xfer_flush (void *owner) {
+
+	dev_xfer_cancel_owner(owner);
+	wait_event(xfer_idle, dev_xfer_owner_idle(owner));
+}
+
+/* Sets up the transmit queues of a file (or of the poll list, with pid 0).
+ * comm must be set already. */
+static void dev_flow_init (struct pruss_flow *flow, pid_t pid) {
+
+	u8 prio;
+
+	for (prio = 0; prio < PRUSS_PRIO_NR; prio++) {
+		INIT_LIST_HEAD(&flow->queue[prio]);
+		INIT_LIST_HEAD(&flow->node[prio]);
+	}
+
+	flow->weight = 1;
+	flow->pid = pid;
+
+	spin_lock_irq(&xfer_lock);
+	list_add_tail(&flow->all, &xfer_flow_all);
+	spin_unlock_irq(&xfer_lock);
+}
+
+/* Forgets a flow, once flushed */
+static void dev_flow_remove (struct pruss_flow *flow) {
+
+	spin_lock_irq(&xfer_lock);
+	list_del(&flow->all);
+	spin_unlock_irq(&xfer_lock);
+}
+
+static int dev_set_weight (struct pruss_client *client, unsigned long weight) {
+
+	if (!weight || weight > XFER_WEIGHT_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&xfer_lock);
+	client->flow.weight = weight;
+	spin_unlock_irq(&xfer_lock);
+
+	return 0;
+}
+
+static int dev_get_client_stats (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_client_stats stats;
+
+	spin_lock_irq(&xfer_lock);
+	stats = client->flow.stats;
+	stats.weight = client->flow.weight;
+	spin_unlock_irq(&xfer_lock);
+
+	return copy_to_user((void __user *) arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+/* debugfs pruss485/clients: bus usage of every open file and of the poll list */
+static int clients_show (struct seq_file *m, void *v) {
+
+	struct pruss_flow *flow;
+
+	seq_printf(m, "%-7s %-16s %6s %10s %12s %12s %14s %12s %12s %6s\n", "pid", "comm", "weight",
+			"xfers", "tx_bytes", "rx_bytes", "bus_ns", "queue_avg_ns", "queue_max_ns", "queued");
+
+	spin_lock_irq(&xfer_lock);
+	list_for_each_entry(flow, &xfer_flow_all, all) {
+
+		struct pruss_client_stats *stats = &flow->stats;
+
+		seq_printf(m, "%-7d %-16s %6u %10llu %12llu %12llu %14llu %12llu %12llu %6u\n",
+				flow->pid, flow->comm, flow->weight, stats->xfers, stats->tx_bytes,
+				stats->rx_bytes, stats->bus_ns,
+				stats->xfers ? div64_u64(stats->queue_ns, stats->xfers) : 0,
+				stats->queue_max_ns, stats->queued);
+	}
+	spin_unlock_irq(&xfer_lock);
+
+	return 0;
+}
+
+static int clients_open (struct inode *inode, struct file *file) {
+
+	return single_open(file, clients_show, NULL);
+}
+
+static const struct file_operations clients_fops = {
+		.owner = THIS_MODULE,
+		.open = clients_open,
+		.read = seq_read,
+		.llseek = seq_lseek,
+		.release = single_release,
+};
+
+static void dev_xfer_wake (struct pruss_xfer *xfer) {
+
+	complete(xfer->priv);
+}
+
+/* Priority class of a transaction of the file, given its flags */
+static u8 dev_xfer_prio (struct pruss_client *client, u32 flags) {
+
+	if (flags & PRUSS_XFER_URGENT)
+		return PRUSS_PRIO_URGENT;
+	if (flags & PRUSS_XFER_CYCLIC)
+		return PRUSS_PRIO_CYCLIC;
+	if (flags & PRUSS_XFER_BULK)
+		return PRUSS_PRIO_BULK;
+
+	return READ_ONCE(client->prio);
+}
+
+/* Longest wait of a blocking write on the file, in jiffies */
+static long dev_deadline (struct pruss_client *client) {
+
+	u32 ms = READ_ONCE(client->deadline_ms);
+
+	return ms ? msecs_to_jiffies(ms) : MAX_SCHEDULE_TIMEOUT;
+}
+
+/* Takes the file lock and makes sure its request and answer buffers exist */
+static int dev_xfer_lock (struct pruss_client *client) {
+
+	if (mutex_lock_interruptible(&client->lock))
+		return -ERESTARTSYS;
+
+	if (!client->req)
+		client->req = kmalloc(TX_FRAME_MAX, GFP_KERNEL);
+	if (!client->resp)
+		client->resp = kmalloc(RX_FRAME_MAX, GFP_KERNEL);
+
+	if (!client->req || !client->resp) {
+		mutex_unlock(&client->lock);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Sends the request of the file at launch (now if zero) and waits for the
+ * answer, which is kept for the next read on the same file. xfer is returned
+ * as completed. Must be called with the file lock held. */
+static int dev_xfer_send_locked (struct pruss_client *client, size_t len,
+		ktime_t launch, u32 flags, struct pruss_xfer *xfer_out) {
+
+	DECLARE_COMPLETION_ONSTACK(done);
+	long left;
+	struct pruss_xfer xfer = {
+		.req = client->req,
+		.req_len = len,
+		.resp = client->resp,
+		.resp_max = RX_FRAME_MAX,
+		.t_launch = launch,
+		.flags = flags,
+		.prio = dev_xfer_prio(client, flags),
+		.owner = client,
+		.flow = &client->flow,
+		.done = dev_xfer_wake,
+		.priv = &done,
+	};
+	int err;
+
+	client->resp_len = 0;
+
+	err = dev_xfer_submit(&xfer);
+	if (!err) {
+
+		/* Only a fatal signal interrupts the wait: restarting the call
+		 * would send the request again */
+		left = wait_for_completion_killable_timeout(&done, dev_deadline(client));
+		if (left <= 0) {
+			dev_xfer_cancel(&xfer);
+			wait_for_completion(&done);
+		}
+
+		if (xfer.status == -ECANCELED)
+			err = left < 0 ? -EINTR : left ? -ECANCELED : -ETIMEDOUT;
+
+		client->resp_len = xfer.resp_len;
+	}
+
+	if (xfer_out)
+		*xfer_out = xfer;
+
+	return err;
+}
+
+/* Master mode send of a request from user space, see dev_xfer_send_locked() */
+static int dev_xfer_send (struct pruss_client *client, const char __user *buffer, size_t len,
+		ktime_t launch, u32 flags, struct pruss_xfer *xfer_out) {
+
+	int err;
+
+	if (!len || len > TX_FRAME_MAX)
+		return -EINVAL;
+
+	err = dev_xfer_lock(client);
+	if (err)
+		return err;
+
+	if (copy_from_user(client->req, buffer, len))
+		err = -EFAULT;
+	else
+		err = dev_xfer_send_locked(client, len, launch, flags, xfer_out);
+
+	mutex_unlock(&client->lock);
+
+	return err;
+}
+
+/* Cancels the transactions of the file, or of everybody with
+ * PRUSS_CANCEL_ALL, along with a slave write waiting for the PRU */
+static int dev_cancel (struct pruss_client *client, unsigned long flags) {
+
+	if (flags & ~PRUSS_CANCEL_ALL)
+		return -EINVAL;
+
+	dev_xfer_cancel_owner(flags & PRUSS_CANCEL_ALL ? NULL : client);
+
+	spin_lock_irq(&rx_lock);
+	if (tx_pending && ((flags & PRUSS_CANCEL_ALL) || tx_owner == client)) {
+		tx_cancelled = true;
+		complete(&intr_completion);
+	}
+	spin_unlock_irq(&rx_lock);
+
+	return 0;
+}
+
+/* Completion of an asynchronous write: its answer is kept for the next read
+ * and the request is completed, from interruption or timer context */
+static void dev_aio_done (struct pruss_xfer *xfer) {
+
+	struct pruss_cmd *cmd = container_of(xfer, struct pruss_cmd, xfer);
+	struct pruss_client *client = cmd->client;
+	struct kiocb *iocb = cmd->iocb;
+	long res = xfer->status ? xfer->status : xfer->req_len;
+	unsigned long flags;
+
+	spin_lock_irqsave(&client->cq_lock, flags);
+	list_add_tail(&xfer->node, &client->answers);
+	client->inflight--;
+	spin_unlock_irqrestore(&client->cq_lock, flags);
+
+	wake_up_interruptible(&client->cq_wait);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	iocb->ki_complete(iocb, res);
+#else
+	iocb->ki_complete(iocb, res, 0);
+#endif
+}
+
+/* Master mode write. Synchronous writes wait for the answer. Asynchronous
+ * ones (io_uring, AIO) are queued and completed from the interruption once
+ * answered; their answers are read in completion order. */
+static ssize_t dev_xfer_write (struct pruss_client *client, struct kiocb *iocb, struct iov_iter *from) {
+
+	size_t len = iov_iter_count(from);
+	struct pruss_cmd *cmd;
+	unsigned long flags;
+	int err;
+
+	if (!len || len > TX_FRAME_MAX)
+		return -EINVAL;
+
+	if (is_sync_kiocb(iocb)) {
+
+		/* Waiting for the answer would block */
+		if (iocb->ki_flags & IOCB_NOWAIT)
+			return -EAGAIN;
+
+		err = dev_xfer_lock(client);
+		if (err)
+			return err;
+
+		if (copy_from_iter(client->req, len, from) != len)
+			err = -EFAULT;
+		else
+			err = dev_xfer_send_locked(client, len, 0, 0, NULL);
+
+		mutex_unlock(&client->lock);
+
+		return err ? err : len;
+	}
+
+	/* Queuing only takes spinlocks, so only the allocation could block */
+	cmd = kmalloc(sizeof(*cmd) + RX_FRAME_MAX,
+			(iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+	if (!cmd)
+		return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+
+	if (copy_from_iter(cmd->req, len, from) != len) {
+		kfree(cmd);
+		return -EFAULT;
+	}
+
+	memset(&cmd->xfer, 0, sizeof(cmd->xfer));
+	cmd->client = client;
+	cmd->iocb = iocb;
+	cmd->xfer.req = cmd->req;
+	cmd->xfer.req_len = len;
+	cmd->xfer.resp = cmd->resp;
+	cmd->xfer.resp_max = RX_FRAME_MAX;
+	cmd->xfer.prio = dev_xfer_prio(client, 0);
+	cmd->xfer.owner = client;
+	cmd->xfer.flow = &client->flow;
+	cmd->xfer.done = dev_aio_done;
+
+	/* Unread answers are bounded apart, so they do not starve PRUSS_SUBMIT */
+	spin_lock_irqsave(&client->cq_lock, flags);
+	if (client->inflight >= SUBMIT_INFLIGHT_MAX || client->aio_inflight >= SUBMIT_INFLIGHT_MAX) {
+		spin_unlock_irqrestore(&client->cq_lock, flags);
+		kfree(cmd);
+		return -EAGAIN;
+	}
+	client->inflight++;
+	client->aio_inflight++;
+	spin_unlock_irqrestore(&client->cq_lock, flags);
+
+	err = dev_xfer_submit(&cmd->xfer);
+	if (err) {
+		spin_lock_irqsave(&client->cq_lock, flags);
+		client->inflight--;
+		client->aio_inflight--;
+		spin_unlock_irqrestore(&client->cq_lock, flags);
+		kfree(cmd);
+		return err;
+	}
+
+	return -EIOCBQUEUED;
+}
+
+/* Sends a request at an absolute time and reports how late it was sent */
+static int dev_send_at (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_txtime txtime;
+	struct pruss_xfer xfer;
+	int err;
+
+	if (copy_from_user(&txtime, (void __user *) arg, sizeof(txtime)))
+		return -EFAULT;
+
+	if (!txtime.launch_ns || txtime.flags & ~PRUSS_XFER_FLAGS)
+		return -EINVAL;
+
+	err = dev_xfer_send(client, u64_to_user_ptr(txtime.buf), txtime.len,
+			ns_to_ktime(txtime.launch_ns), txtime.flags, &xfer);
+	if (err)
+		return err;
+
+	txtime.lateness_ns = ktime_to_ns(ktime_sub(xfer.t_start, xfer.t_launch));
+	txtime.resp_len = xfer.resp_len;
+
+	if (copy_to_user((void __user *) arg, &txtime, sizeof(txtime)))
+		return -EFAULT;
+
+	return xfer.status == -ETIMEDOUT ? -ETIMEDOUT : 0;
+}
+
+/* Completion of a tagged transaction, from interruption or timer context */
+static void dev_cmd_done (struct pruss_xfer *xfer) {
+
+	struct pruss_cmd *cmd = container_of(xfer, struct pruss_cmd, xfer);
+	struct pruss_client *client = cmd->client;
+	unsigned long flags;
+
+	spin_lock_irqsave(&client->cq_lock, flags);
+	list_add_tail(&xfer->node, &client->cq);
+	spin_unlock_irqrestore(&client->cq_lock, flags);
+
+	wake_up_interruptible(&client->cq_wait);
+}
+
+/* Queues a tagged transaction without waiting for it */
+static int dev_submit (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_submit sub;
+	struct pruss_cmd *cmd;
+	unsigned long flags;
+	int err;
+
+	if (copy_from_user(&sub, (void __user *) arg, sizeof(sub)))
+		return -EFAULT;
+
+	if (!sub.req_len || sub.req_len > TX_FRAME_MAX || sub.resp_max > RX_FRAME_MAX ||
+			sub.flags & ~PRUSS_XFER_FLAGS)
+		return -EINVAL;
+
+	cmd = kmalloc(sizeof(*cmd) + sub.resp_max, GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+
+	if (copy_from_user(cmd->req, u64_to_user_ptr(sub.req), sub.req_len)) {
+		kfree(cmd);
+		return -EFAULT;
+	}
+
+	memset(&cmd->xfer, 0, sizeof(cmd->xfer));
+	cmd->client = client;
+	cmd->tag = sub.tag;
+	cmd->user_resp = sub.resp;
+	cmd->xfer.req = cmd->req;
+	cmd->xfer.req_len = sub.req_len;
+	cmd->xfer.resp = cmd->resp;
+	cmd->xfer.resp_max = sub.resp_max;
+	cmd->xfer.t_launch = ns_to_ktime(sub.launch_ns);
+	cmd->xfer.flags = sub.flags;
+	cmd->xfer.prio = dev_xfer_prio(client, sub.flags);
+	cmd->xfer.owner = client;
+	cmd->xfer.flow = &client->flow;
+	cmd->xfer.done = dev_cmd_done;
+
+	spin_lock_irqsave(&client->cq_lock, flags);
+	if (client->inflight >= SUBMIT_INFLIGHT_MAX) {
+		spin_unlock_irqrestore(&client->cq_lock, flags);
+		kfree(cmd);
+		return -EAGAIN;
+	}
+	client->inflight++;
+	spin_unlock_irqrestore(&client->cq_lock, flags);
+
+	err = dev_xfer_submit(&cmd->xfer);
+	if (err) {
+		spin_lock_irqsave(&client->cq_lock, flags);
+		client->inflight--;
+		spin_unlock_irqrestore(&client->cq_lock, flags);
+		kfree(cmd);
+	}
+
+	return err;
+}
+
+/* Takes the first completed transaction of the file, if any */
+static struct pruss_cmd *dev_cq_pop (struct pruss_client *client) {
+
+	struct pruss_cmd *cmd = NULL;
+
+	spin_lock_irq(&client->cq_lock);
+	if (!list_empty(&client->cq)) {
+		cmd = container_of(list_first_entry(&client->cq, struct pruss_xfer, node), struct pruss_cmd, xfer);
+		list_del(&cmd->xfer.node);
+		client->inflight--;
+	}
+	spin_unlock_irq(&client->cq_lock);
+
+	return cmd;
+}
+
+/* Gives back a completion which could not be returned, at the head of the
+ * completion queue so that it is reaped first next time */
+static void dev_cq_unpop (struct pruss_client *client, struct pruss_cmd *cmd) {
+
+	spin_lock_irq(&client->cq_lock);
+	list_add(&cmd->xfer.node, &client->cq);
+	client->inflight++;
+	spin_unlock_irq(&client->cq_lock);
+}
+
+/* Returns completed transactions, their answers copied into the buffers given
+ * at submission */
+static int dev_reap (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_completion __user *out;
+	struct pruss_completion comp;
+	struct pruss_reap reap;
+	struct pruss_cmd *cmd;
+	int count = 0;
+
+	if (copy_from_user(&reap, (void __user *) arg, sizeof(reap)))
+		return -EFAULT;
+
+	if (reap.flags & ~PRUSS_REAP_WAIT)
+		return -EINVAL;
+
+	if ((reap.flags & PRUSS_REAP_WAIT) &&
+			wait_event_interruptible(client->cq_wait, !list_empty_careful(&client->cq)))
+		return -ERESTARTSYS;
+
+	out = u64_to_user_ptr(reap.completions);
+
+	while (count < reap.max && (cmd = dev_cq_pop(client))) {
+
+		comp.tag = cmd->tag;
+		comp.status = cmd->xfer.status;
+		comp.resp_len = cmd->xfer.resp_len;
+		comp.t_submit_ns = ktime_to_ns(cmd->xfer.t_submit);
+		comp.t_start_ns = ktime_to_ns(cmd->xfer.t_start);
+		comp.t_done_ns = ktime_to_ns(cmd->xfer.t_done);
+
+		if ((comp.resp_len && copy_to_user(u64_to_user_ptr(cmd->user_resp), cmd->resp, comp.resp_len)) ||
+				copy_to_user(out + count, &comp, sizeof(comp))) {
+			dev_cq_unpop(client, cmd);
+			return count ? count : -EFAULT;
+		}
+
+		kfree(cmd);
+		count++;
+	}
+
+	return count;
+}
+
+/* Posts a completion in the shared ring */
+static void dev_ring_post (struct pruss_ring *ring, u64 tag, int status, u16 resp_len, u16 slot, ktime_t t_done) {
+
+	struct pruss_ring_hdr *hdr = ring->hdr;
+	struct pruss_cqe *cqe;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ring->cq_lock, flags);
+
+	if (ring->cq_tail - READ_ONCE(hdr->cq_head) >= 2 * ring->entries)
+		WRITE_ONCE(hdr->cq_overflow, hdr->cq_overflow + 1);
+	else {
+		cqe = &ring->cqes[ring->cq_tail & (2 * ring->entries - 1)];
+		cqe->tag = tag;
+		cqe->status = status;
+		cqe->resp_len = resp_len;
+		cqe->slot = slot;
+		cqe->t_done_ns = ktime_to_ns(t_done);
+		smp_store_release(&hdr->cq_tail, ++ring->cq_tail);
+	}
+
+	spin_unlock_irqrestore(&ring->cq_lock, flags);
+
+	wake_up_interruptible(&ring->client->cq_wait);
+}
+
+/* Completion of a transaction taken from the ring: the answer is already in
+ * its data slot, which can be reused once the completion is posted */
+static void dev_ring_cmd_done (struct pruss_xfer *xfer) {
+
+	struct pruss_ring_cmd *cmd = container_of(xfer, struct pruss_ring_cmd, xfer);
+
+	WRITE_ONCE(cmd->busy, false);
+	dev_ring_post(cmd->ring, cmd->tag, xfer->status, xfer->resp_len, cmd->slot, xfer->t_done);
+}
+
+/* Takes the new submission entries. Returns how many were taken. */
+static int dev_ring_consume (struct pruss_ring *ring) {
+
+	struct pruss_ring_hdr *hdr = ring->hdr;
+	struct pruss_ring_cmd *cmd;
+	struct pruss_sqe sqe;
+	u32 tail;
+	int count = 0, err;
+
+	mutex_lock(&ring->sq_mutex);
+
+	tail = smp_load_acquire(&hdr->sq_tail);
+
+	while (ring->sq_head != tail && (u32) (tail - ring->sq_head) <= ring->entries) {
+
+		memcpy(&sqe, &ring->sqes[ring->sq_head & (ring->entries - 1)], sizeof(sqe));
+		ring->sq_head++;
+		count++;
+
+		if (sqe.slot >= ring->entries || !sqe.req_len || sqe.req_len > RING_REQ_MAX ||
+				sqe.resp_max > RING_RESP_MAX || sqe.flags & ~PRUSS_XFER_FLAGS) {
+			dev_ring_post(ring, sqe.tag, -EINVAL, 0, sqe.slot, ktime_get());
+			continue;
+		}
+
+		cmd = &ring->cmds[sqe.slot];
+		if (READ_ONCE(cmd->busy)) {
+			dev_ring_post(ring, sqe.tag, -EBUSY, 0, sqe.slot, ktime_get());
+			continue;
+		}
+
+		/* The request is copied, the answer goes straight into the slot */
+		memcpy(cmd->req, ring->data + sqe.slot * RING_SLOT_SIZE, sqe.req_len);
+
+		memset(&cmd->xfer, 0, sizeof(cmd->xfer));
+		cmd->tag = sqe.tag;
+		cmd->slot = sqe.slot;
+		cmd->xfer.req = cmd->req;
+		cmd->xfer.req_len = sqe.req_len;
+		cmd->xfer.resp = ring->data + sqe.slot * RING_SLOT_SIZE + RING_REQ_MAX;
+		cmd->xfer.resp_max = sqe.resp_max;
+		cmd->xfer.t_launch = ns_to_ktime(sqe.launch_ns);
+		cmd->xfer.flags = sqe.flags;
+		cmd->xfer.prio = dev_xfer_prio(ring->client, sqe.flags);
+		cmd->xfer.owner = ring->client;
+		cmd->xfer.flow = &ring->client->flow;
+		cmd->xfer.done = dev_ring_cmd_done;
+		cmd->busy = true;
+
+		err = dev_xfer_submit(&cmd->xfer);
+		if (err) {
+			cmd->busy = false;
+			dev_ring_post(ring, sqe.tag, err, 0, sqe.slot, ktime_get());
+		}
+	}
+
+	smp_store_release(&hdr->sq_head, ring->sq_head);
+
+	mutex_unlock(&ring->sq_mutex);
+
+	return count;
+}
+
+/* Kernel thread taking submissions while the ring is busy. It sleeps after
+ * idle_ms without any, asking for PRUSS_RING_ENTER through the header flags. */
+static int dev_ring_poller (void *data) {
+
+	struct pruss_ring *ring = data;
+	unsigned long idle_since = jiffies;
+
+	while (!kthread_should_stop()) {
+
+		if (dev_ring_consume(ring)) {
+			idle_since = jiffies;
+			continue;
+		}
+
+		if (time_before(jiffies, idle_since + msecs_to_jiffies(ring->idle_ms))) {
+			usleep_range(RING_POLL_US, 2 * RING_POLL_US);
+			continue;
+		}
+
+		WRITE_ONCE(ring->hdr->flags, ring->hdr->flags | PRUSS_RING_NEED_WAKEUP);
+		smp_mb();
+
+		/* Submissions made before the flag was seen */
+		if (!dev_ring_consume(ring))
+			wait_event_interruptible(ring->poller_wait, READ_ONCE(ring->wake) || kthread_should_stop());
+
+		WRITE_ONCE(ring->wake, false);
+		WRITE_ONCE(ring->hdr->flags, ring->hdr->flags & ~PRUSS_RING_NEED_WAKEUP);
+		idle_since = jiffies;
+	}
+
+	return 0;
+}
+
+/* Sets the shared rings of the file up */
+static int dev_setup_ring (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_ring_setup setup;
+	struct pruss_ring *ring;
+	size_t sq_off, cq_off, data_off;
+	u32 i;
+
+	if (copy_from_user(&setup, (void __user *) arg, sizeof(setup)))
+		return -EFAULT;
+
+	if (!setup.entries || setup.entries > RING_ENTRIES_MAX || !is_power_of_2(setup.entries) ||
+			setup.flags & ~PRUSS_RING_SQPOLL)
+		return -EINVAL;
+
+	sq_off = ALIGN(sizeof(struct pruss_ring_hdr), 64);
+	cq_off = sq_off + setup.entries * sizeof(struct pruss_sqe);
+	data_off = ALIGN(cq_off + 2 * setup.entries * sizeof(struct pruss_cqe), 64);
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->size = PAGE_ALIGN(data_off + setup.entries * RING_SLOT_SIZE);
+	ring->area = vmalloc_user(ring->size);
+	ring->cmds = kcalloc(setup.entries, sizeof(*ring->cmds), GFP_KERNEL);
+	if (!ring->area || !ring->cmds) {
+		vfree(ring->area);
+		kfree(ring->cmds);
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->client = client;
+	ring->entries = setup.entries;
+	ring->idle_ms = setup.idle_ms;
+	ring->hdr = ring->area;
+	ring->sqes = ring->area + sq_off;
+	ring->cqes = ring->area + cq_off;
+	ring->data = ring->area + data_off;
+	mutex_init(&ring->sq_mutex);
+	spin_lock_init(&ring->cq_lock);
+	init_waitqueue_head(&ring->poller_wait);
+
+	for (i = 0; i < setup.entries; i++)
+		ring->cmds[i].ring = ring;
+
+	ring->hdr->sq_entries = setup.entries;
+	ring->hdr->cq_entries = 2 * setup.entries;
+	ring->hdr->sq_off = sq_off;
+	ring->hdr->cq_off = cq_off;
+	ring->hdr->data_off = data_off;
+	ring->hdr->slot_size = RING_SLOT_SIZE;
+
+	mutex_lock(&client->lock);
+	if (client->ring) {
+		mutex_unlock(&client->lock);
+		vfree(ring->area);
+		kfree(ring->cmds);
+		kfree(ring);
+		return -EBUSY;
+	}
+
+	if (setup.flags & PRUSS_RING_SQPOLL) {
+		ring->poller = kthread_run(dev_ring_poller, ring, "pruss485-sq");
+		if (IS_ERR(ring->poller)) {
+			int err = PTR_ERR(ring->poller);
+
+			mutex_unlock(&client->lock);
+			vfree(ring->area);
+			kfree(ring->cmds);
+			kfree(ring);
+			return err;
+		}
+	}
+
+	client->ring = ring;
+	mutex_unlock(&client->lock);
+
+	setup.size = ring->size;
+	return copy_to_user((void __user *) arg, &setup, sizeof(setup)) ? -EFAULT : 0;
+}
+
+/* Doorbell: takes the new submissions, or wakes the poller thread up, then
+ * waits for min_complete completions to be pending */
+static int dev_ring_enter (struct pruss_client *client, unsigned long min_complete) {
+
+	struct pruss_ring *ring = READ_ONCE(client->ring);
+	int count = 0;
+
+	if (!ring)
+		return -EINVAL;
+
+	if (ring->poller) {
+		WRITE_ONCE(ring->wake, true);
+		wake_up_interruptible(&ring->poller_wait);
+	}
+	else
+		count = dev_ring_consume(ring);
+
+	if (min_complete && wait_event_interruptible(client->cq_wait,
+			smp_load_acquire(&ring->hdr->cq_tail) - READ_ONCE(ring->hdr->cq_head) >= min_complete))
+		return -ERESTARTSYS;
+
+	return count;
+}
+
+/* Stops the poller thread and frees the rings, once the transactions of the
+ * file are over */
+static void dev_ring_cleanup (struct pruss_ring *ring) {
+
+	if (!ring)
+		return;
+
+	if (ring->poller)
+		kthread_stop(ring->poller);
+
+	dev_xfer_flush(ring->client);
+
+	mutex_destroy(&ring->sq_mutex);
+	vfree(ring->area);
+	kfree(ring->cmds);
+	kfree(ring);
+}
+
+/* Master mode read: answer to the next asynchronous write completed, or to
+ * the last request written on this file. Without any, waits for the pending
+ * asynchronous writes, if any, or fails with -EAGAIN if nonblocking. */
+static ssize_t dev_xfer_read (struct pruss_client *client, struct iov_iter *to, bool nonblock) {
+
+	size_t len = iov_iter_count(to);
+	struct pruss_cmd *cmd;
+	ssize_t count;
+	u32 pending;
+
+	for (;;) {
+
+		cmd = NULL;
+
+		spin_lock_irq(&client->cq_lock);
+		if (!list_empty(&client->answers)) {
+			cmd = container_of(list_first_entry(&client->answers, struct pruss_xfer, node), struct pruss_cmd, xfer);
+			list_del(&cmd->xfer.node);
+			client->aio_inflight--;
+		}
+		pending = client->aio_inflight;
+		spin_unlock_irq(&client->cq_lock);
+
+		if (cmd) {
+			count = min_t(size_t, cmd->xfer.resp_len, len);
+			if (copy_to_iter(cmd->resp, count, to) != count)
+				count = -EFAULT;
+			kfree(cmd);
+			return count;
+		}
+
+		if (nonblock) {
+			if (!mutex_trylock(&client->lock))
+				return -EAGAIN;
+		}
+		else if (mutex_lock_interruptible(&client->lock))
+			return -ERESTARTSYS;
+
+		count = min_t(size_t, client->resp_len, len);
+		client->resp_len = 0;
+
+		if (count && copy_to_iter(client->resp, count, to) != count)
+			count = -EFAULT;
+
+		mutex_unlock(&client->lock);
+
+		if (count)
+			return count;
+
+		if (nonblock)
+			return -EAGAIN;
+
+		/* Nothing will come */
+		if (!pending)
+			return 0;
+
+		if (wait_event_interruptible(client->cq_wait, !list_empty_careful(&client->answers)))
+			return -ERESTARTSYS;
+	}
+}
+
+/* Publishes the answer of a poll list entry in the result table */
+static void dev_poll_done (struct pruss_xfer *xfer) {
+
+	struct pruss_poll *poll = xfer->priv;
+	struct pruss_poll_result *res = &poll_results[poll->entry.slot];
+
+	if (xfer->status == -ECANCELED) {
+		WRITE_ONCE(poll->busy, false);
+		return;
+	}
+
+	res->seq++;
+	smp_wmb();
+	res->status = xfer->status;
+	res->len = xfer->resp_len;
+	res->ts_ns = ktime_to_ns(xfer->t_done);
+	memcpy(res->data, xfer->resp, xfer->resp_len);
+	smp_wmb();
+	res->seq++;
+
+	WRITE_ONCE(poll->busy, false);
+}
+
+/* Submits the poll list entries which are due and sleeps until the next one */
+static enum hrtimer_restart dev_poll_timer (struct hrtimer *timer) {
+
+	ktime_t now = ktime_get(), next = ktime_add_ns(now, NSEC_PER_SEC);
+	u16 i;
+
+	for (i = 0; i < poll_n; i++) {
+
+		struct pruss_poll *poll = &poll_list[i];
+		u64 period = (u64) poll->entry.period_us * NSEC_PER_USEC;
+
+		if (!ktime_after(poll->next, now)) {
+
+			if (READ_ONCE(poll->busy))
+				poll_results[poll->entry.slot].overruns++;
+			else {
+				poll->busy = true;
+				if (dev_xfer_submit(&poll->xfer))
+					poll->busy = false;
+			}
+
+			/* Keeps the cycle phase, skipping the cycles which were missed */
+			poll->next = ktime_add_ns(poll->next, period);
+			if (!ktime_after(poll->next, now))
+				poll->next = ktime_add_ns(poll->next,
+						(div64_u64(ktime_to_ns(ktime_sub(now, poll->next)), period) + 1) * period);
+		}
+
+		if (ktime_before(poll->next, next))
+			next = poll->next;
+	}
+
+	hrtimer_set_expires(timer, next);
+	return HRTIMER_RESTART;
+}
+
+/* Replaces the poll list. It must be stopped. */
+static int dev_set_poll_list (unsigned long arg) {
+
+	struct pruss_poll_list *list;
+	struct pruss_poll *polls = NULL;
+	int err = 0;
+	u16 i;
+
+	list = kmalloc(sizeof(*list), GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+
+	if (copy_from_user(list, (void __user *) arg, sizeof(*list))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	if (list->n_entries > POLL_ENTRIES_MAX) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < list->n_entries; i++) {
+		struct pruss_poll_entry *e = &list->entries[i];
+
+		if (!e->period_us || e->slot >= POLL_ENTRIES_MAX || !e->req_len ||
+				e->req_len > POLL_REQ_MAX || e->resp_max > POLL_RESP_MAX) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (list->n_entries) {
+		polls = kcalloc(list->n_entries, sizeof(*polls), GFP_KERNEL);
+		if (!polls) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < list->n_entries; i++) {
+		polls[i].entry = list->entries[i];
+		polls[i].xfer.req = polls[i].entry.req;
+		polls[i].xfer.req_len = polls[i].entry.req_len;
+		polls[i].xfer.resp = polls[i].resp;
+		polls[i].xfer.resp_max = polls[i].entry.resp_max;
+		polls[i].xfer.prio = PRUSS_PRIO_CYCLIC;
+		polls[i].xfer.owner = &poll_list;
+		polls[i].xfer.flow = &poll_flow;
+		polls[i].xfer.done = dev_poll_done;
+		polls[i].xfer.priv = &polls[i];
+	}
+
+	mutex_lock(&poll_mutex);
+	if (poll_running) {
+		mutex_unlock(&poll_mutex);
+		kfree(polls);
+		err = -EBUSY;
+		goto out;
+	}
+
+	kfree(poll_list);
+	poll_list = polls;
+	poll_n = list->n_entries;
+	memset(poll_results, 0, POLL_ENTRIES_MAX * sizeof(*poll_results));
+	mutex_unlock(&poll_mutex);
+
+out:
+	kfree(list);
+	return err;
+}
+
+static int dev_start_poll (void) {
+
+	ktime_t now = ktime_get();
+	u16 i;
+
+	mutex_lock(&poll_mutex);
+
+	if (poll_running || !poll_n) {
+		mutex_unlock(&poll_mutex);
+		return poll_running ? -EBUSY : -EINVAL;
+	}
+
+	for (i = 0; i < poll_n; i++)
+		poll_list[i].next = now;
+
+	poll_running = true;
+	hrtimer_start(&poll_timer, now, HRTIMER_MODE_ABS);
+
+	mutex_unlock(&poll_mutex);
+
+	return 0;
+}
+
+/* Stops the poll list and waits for its transactions to be over */
+static int dev_stop_poll (void) {
+
+	mutex_lock(&poll_mutex);
+
+	if (poll_running) {
+		hrtimer_cancel(&poll_timer);
+		dev_xfer_flush(&poll_list);
+		poll_running = false;
+	}
+
+	mutex_unlock(&poll_mutex);
+
+	return 0;
+}
+
+/* Whether the slots of a TDMA table are valid, do not overlap and fit in the
+ * period, nominal or else measured, if known. One of them must be ours. */
+static bool dev_tdma_valid (const struct pruss_tdma_table *table) {
+
+	const struct pruss_tdma_slot *a, *b;
+	bool ours = false;
+	u64 period;
+	u8 i, j;
+
+	spin_lock_irq(&sync_lock);
+	period = sync_nominal_ns ? sync_nominal_ns : sync_period_ns;
+	spin_unlock_irq(&sync_lock);
+
+	for (i = 0; i < table->n_slots; i++) {
+
+		a = &table->slots[i];
+		if (!a->length_us || (period &&
+				((u64) a->offset_us + a->length_us) * NSEC_PER_USEC > period))
+			return false;
+
+		for (j = 0; j < i; j++) {
+			b = &table->slots[j];
+			if ((u64) a->offset_us < (u64) b->offset_us + b->length_us &&
+					(u64) b->offset_us < (u64) a->offset_us + a->length_us)
+				return false;
+		}
+
+		ours |= a->node == table->node;
+	}
+
+	return ours;
+}
+
+/* Replaces the TDMA schedule. A transaction waiting for its slot is placed
+ * again with the new one. Slots are placed from the sync pulses, so they need
+ * the pulse event to be timed. */
+static int dev_set_tdma (unsigned long arg) {
+
+	struct pruss_tdma_table *table;
+	void __iomem *p = dev_shram();
+	unsigned long flags;
+
+	table = kmalloc(sizeof(*table), GFP_KERNEL);
+	if (!table)
+		return -ENOMEM;
+
+	if (copy_from_user(table, (void __user *) arg, sizeof(*table))) {
+		kfree(table);
+		return -EFAULT;
+	}
+
+	if (table->n_slots > TDMA_SLOTS_MAX || (table->n_slots && table->node == PRUSS_ADDR_BROADCAST)) {
+		kfree(table);
+		return -EINVAL;
+	}
+
+	if (table->n_slots && !dev_sync_timed()) {
+		kfree(table);
+		return -EOPNOTSUPP;
+	}
+
+	if (table->n_slots && !dev_tdma_valid(table)) {
+		kfree(table);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&xfer_lock, flags);
+	tdma = *table;
+	if (xfer_launching && p && hrtimer_try_to_cancel(&xfer_timer) >= 0)
+		dev_xfer_launch_or_wait_locked(p, xfer_active);
+	spin_unlock_irqrestore(&xfer_lock, flags);
+
+	kfree(table);
+	return 0;
+}
+
+/* Copies the sync state into the page shared with user space. Must be called
+ * with sync_lock held. */
+static void dev_sync_publish_locked (void) {
+
+	struct pruss_sync_page *page = sync_page;
+
+	if (!page)
+		return;
+
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+	page->state = sync_state;
+	page->pulses = sync_pulses;
+	page->last_ns = ktime_to_ns(sync_last);
+	page->period_ns = sync_period_ns;
+	page->counter = sync_count - sync_count_base;
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+}
+
+/* Extends the PRU pulse counter with its current value. It is read at each
+ * pulse, so it cannot wrap unseen while the sync interruption is served. Must
+ * be called with sync_lock held. */
+static void dev_sync_extend_locked (u16 raw) {
+
+	sync_count += (u16) (raw - sync_raw);
+	sync_raw = raw;
+}
+
+/* The PRU pulse counter was written: the extended counter follows it */
+static void dev_sync_set_count (u16 raw) {
+
+	spin_lock_irq(&sync_lock);
+	sync_raw = raw;
+	sync_count = sync_count_base + raw;
+	dev_sync_publish_locked();
+	spin_unlock_irq(&sync_lock);
+}
+
+/* Returns the extended pulse counter, without having to stop sync to clear it
+ * or to watch for the 16-bit counter wrapping */
+static int dev_get_pulse_count64 (void __iomem *p, unsigned long arg) {
+
+	u64 count;
+
+	spin_lock_irq(&sync_lock);
+	dev_sync_extend_locked(ioread16(p + COUNTER_OFFSET));
+	count = sync_count - sync_count_base;
+	spin_unlock_irq(&sync_lock);
+
+	return put_user(count, (u64 __user *) arg);
+}
+
+/* Clears the extended pulse counter. The PRU counter is left running. */
+static int dev_clear_pulse_count64 (void __iomem *p) {
+
+	spin_lock_irq(&sync_lock);
+	dev_sync_extend_locked(ioread16(p + COUNTER_OFFSET));
+	sync_count_base = sync_count;
+	dev_sync_publish_locked();
+	spin_unlock_irq(&sync_lock);
+
+	return 0;
+}
+
+/* Whether the PRU firmware raises sync_sysevt at each pulse. Without it,
+ * nothing can be aligned to pulses and changes are written at once. */
+static bool dev_sync_timed (void) {
+
+	return sync_sysevt >= 0;
+}
+
+/* Routes sync_sysevt to sync_evtout, through the channel of the same number
+ * as the host interruption, as prussdrv does, and enables both. Done at each
+ * PRUSS_START_SYNC, since user space may program the INTC again. */
+static void dev_sync_intc_map (void) {
+
+	struct uio_pruss_dev *gdev = _pdev ? platform_get_drvdata(_pdev) : NULL;
+	void __iomem *intrc;
+	u32 val;
+
+	if (!gdev || sync_sysevt < 0 || sync_evtout < 0)
+		return;
+
+	intrc = gdev->prussio_vaddr + gdev->pintc_base;
+
+	val = ioread32(intrc + PINTC_CMR + (sync_sysevt & ~3));
+	val &= ~(0xff << ((sync_sysevt & 3) * 8));
+	val |= sync_evtout << ((sync_sysevt & 3) * 8);
+	iowrite32(val, intrc + PINTC_CMR + (sync_sysevt & ~3));
+
+	val = ioread32(intrc + PINTC_HMR + (sync_evtout & ~3));
+	val &= ~(0xff << ((sync_evtout & 3) * 8));
+	val |= sync_evtout << ((sync_evtout & 3) * 8);
+	iowrite32(val, intrc + PINTC_HMR + (sync_evtout & ~3));
+
+	iowrite32(sync_sysevt, intrc + PINTC_SICR);
+	iowrite32(sync_sysevt, intrc + PINTC_EISR);
+	iowrite32(sync_evtout, intrc + PINTC_HIEISR);
+}
+
+/* Starts or stops sync. On start, the pulse period is forgotten and measured
+ * again, and the pulse counter, cleared by dev_set_sync_start(), starts from
+ * zero. */
+static void dev_sync_set_running (bool running) {
+
+	if (running)
+		dev_sync_intc_map();
+
+	spin_lock_irq(&sync_lock);
+	if (running) {
+		sync_pulses = 0;
+		sync_period_ns = 0;
+		sync_raw = 0;
+		sync_count = sync_count_base = 0;
+		sync_state |= PRUSS_SYNC_RUNNING;
+	}
+	else {
+		sync_state &= ~PRUSS_SYNC_RUNNING;
+
+		/* No pulse will come to load the selection or write the staged
+		 * configuration */
+		if (dev_shram()) {
+			if (sync_step_pending) {
+				sync_step_cur = sync_step_first;
+				sync_step_pending = false;
+				dev_load_sync_step(dev_shram(), sync_steps[sync_step_cur]);
+			}
+			dev_apply_staged_locked(dev_shram());
+		}
+	}
+	dev_sync_publish_locked();
+	spin_unlock_irq(&sync_lock);
+
+	wake_up_all(&sync_wait);
+
+	/* Transactions no longer wait for the sync window, or wait for the period */
+	if (dev_shram())
+		dev_xfer_replace(dev_shram());
+}
+
+/* Clears the period statistics. Must be called with sync_lock held. */
+static void dev_sync_stats_reset_locked (void) {
+
+	sync_ref_ns = sync_nominal_ns;
+	sync_samples = 0;
+	sync_dev_sum = 0;
+	sync_dev_sq_sum = 0;
+	sync_min_ns = U64_MAX;
+	sync_max_ns = 0;
+	memset(sync_hist, 0, sizeof(sync_hist));
+}
+
+/* Accounts one measured period. Must be called with sync_lock held. */
+static void dev_sync_stats_add_locked (u64 period_ns) {
+
+	s64 dev, bucket;
+	s32 rem;
+
+	if (!sync_ref_ns)
+		sync_ref_ns = period_ns;
+
+	dev = period_ns - sync_ref_ns;
+
+	/* Rounds towards minus infinity */
+	bucket = div_s64_rem(dev, sync_bucket_ns, &rem);
+	if (rem < 0)
+		bucket--;
+	bucket += SYNC_HIST_BUCKETS / 2;
+
+	dev = clamp_t(s64, dev, -SYNC_DEV_MAX_NS, SYNC_DEV_MAX_NS);
+
+	/* The sum of squares would wrap: starts over, this period first */
+	if (sync_dev_sq_sum + dev * dev < sync_dev_sq_sum) {
+		dev_sync_stats_reset_locked();
+		dev_sync_stats_add_locked(period_ns);
+		return;
+	}
+
+	sync_samples++;
+	sync_dev_sum += dev;
+	sync_dev_sq_sum += dev * dev;
+	sync_min_ns = min(sync_min_ns, period_ns);
+	sync_max_ns = max(sync_max_ns, period_ns);
+	sync_hist[clamp_t(s64, bucket, 0, SYNC_HIST_BUCKETS - 1)]++;
+}
+
+/* Snapshot of the period statistics */
+static void dev_sync_stats_get (struct pruss_sync_stats *stats) {
+
+	s64 mean_dev = 0;
+	u64 var = 0;
+
+	memset(stats, 0, sizeof(*stats));
+
+	spin_lock_irq(&sync_lock);
+
+	if (sync_samples) {
+		mean_dev = div64_s64(sync_dev_sum, sync_samples);
+		var = div64_u64(sync_dev_sq_sum, sync_samples);
+		var = var > mean_dev * mean_dev ? var - mean_dev * mean_dev : 0;
+		stats->min_ns = sync_min_ns;
+		stats->max_ns = sync_max_ns;
+		stats->mean_ns = sync_ref_ns + mean_dev;
+	}
+
+	stats->samples = sync_samples;
+	stats->period_ns = sync_nominal_ns;
+	stats->bucket_ns = sync_bucket_ns;
+	memcpy(stats->hist, sync_hist, sizeof(sync_hist));
+
+	spin_unlock_irq(&sync_lock);
+
+	stats->std_ns = int_sqrt64(var);
+}
+
+static int dev_set_sync_period (unsigned long arg) {
+
+	struct pruss_sync_period period;
+
+	if (copy_from_user(&period, (void __user *) arg, sizeof(period)))
+		return -EFAULT;
+
+	if (!period.bucket_ns || period.bucket_ns > S32_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&sync_lock);
+	sync_nominal_ns = period.period_ns;
+	sync_bucket_ns = period.bucket_ns;
+	dev_sync_stats_reset_locked();
+	spin_unlock_irq(&sync_lock);
+
+	return 0;
+}
+
+static int dev_get_sync_stats (unsigned long arg) {
+
+	struct pruss_sync_stats stats;
+
+	dev_sync_stats_get(&stats);
+
+	return copy_to_user((void __user *) arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static int dev_reset_sync_stats (void) {
+
+	spin_lock_irq(&sync_lock);
+	dev_sync_stats_reset_locked();
+	spin_unlock_irq(&sync_lock);
+
+	return 0;
+}
+
+/* debugfs pruss485/sync_stats: statistics in text, cleared by any write */
+static int sync_stats_show (struct seq_file *m, void *v) {
+
+	struct pruss_sync_stats stats;
+	int i;
+
+	dev_sync_stats_get(&stats);
+
+	seq_printf(m, "samples: %llu\n", stats.samples);
+	seq_printf(m, "expected: %llu ns\n", stats.period_ns);
+	seq_printf(m, "mean: %llu ns\n", stats.mean_ns);
+	seq_printf(m, "min: %llu ns\n", stats.min_ns);
+	seq_printf(m, "max: %llu ns\n", stats.max_ns);
+	seq_printf(m, "std: %llu ns\n", stats.std_ns);
+	seq_printf(m, "jitter histogram (%u ns buckets):\n", stats.bucket_ns);
+
+	for (i = 0; i < SYNC_HIST_BUCKETS; i++)
+		seq_printf(m, "%6lld %u\n", (long long) (i - SYNC_HIST_BUCKETS / 2) * stats.bucket_ns, stats.hist[i]);
+
+	return 0;
+}
+
+static int sync_stats_open (struct inode *inode, struct file *file) {
+
+	return single_open(file, sync_stats_show, NULL);
+}
+
+static ssize_t sync_stats_write (struct file *file, const char __user *buf, size_t len, loff_t *off) {
+
+	dev_reset_sync_stats();
+
+	return len;
+}
+
+static const struct file_operations sync_stats_fops = {
+		.owner = THIS_MODULE,
+		.open = sync_stats_open,
+		.read = seq_read,
+		.write = sync_stats_write,
+		.llseek = seq_lseek,
+		.release = single_release,
+};
+
+/* IEP timer of the PRU subsystem, as mapped by pruss_probe() */
+static void __iomem *dev_iep (void) {
+
+	struct uio_pruss_dev *gdev = _pdev ? platform_get_drvdata(_pdev) : NULL;
+
+	return gdev ? gdev->prussio_vaddr + PRUSS_IEP_BASE : NULL;
+}
+
+/* Starts the IEP counter at 1 ns per count, unless the firmware already runs
+ * it with its own increment. Called once, by pruss_probe(). */
+static void dev_iep_start (void) {
+
+	void __iomem *iep = dev_iep();
+
+	if (iep && !(ioread32(iep + IEP_GLOBAL_CFG) & IEP_CNT_ENABLE))
+		iowrite32((IEP_CLK_NS << 8) | (IEP_CLK_NS << 4) | IEP_CNT_ENABLE, iep + IEP_GLOBAL_CFG);
+}
+
+/* Extends an IEP counter value read after the last one into ns. Must be
+ * called with clk_lock held, at least once per counter wrap (4.29 s at 1 ns
+ * per count). */
+static u64 dev_iep_extend_locked (u32 raw) {
+
+	u64 t = (u64) (u32) (raw - iep_last) * IEP_CLK_NS + iep_rem;
+
+	iep_ext += div_u64_rem(t, iep_inc, &iep_rem);
+	iep_last = raw;
+
+	return iep_ext;
+}
+
+/* IEP time of a raw counter value, taken as the closest one to iep_ref. Must
+ * be called with clk_lock held. */
+static u64 dev_iep_unwrap_locked (u32 raw) {
+
+	return clk_corr.iep_ref + div_s64((s64) (s32) (raw - iep_ref_raw) * IEP_CLK_NS, iep_inc);
+}
+
+/* Raw counter value of an IEP time. Must be called with clk_lock held. */
+static u32 dev_iep_wrap_locked (u64 iep) {
+
+	return iep_ref_raw + div_s64((s64) (iep - clk_corr.iep_ref) * iep_inc, IEP_CLK_NS);
+}
+
+/* System time of an IEP time. Must be called with clk_lock held. */
+static u64 dev_iep_to_sys_locked (u64 iep) {
+
+	s64 delta = iep - clk_corr.iep_ref;
+
+	return clk_corr.sys_ref_ns + delta + div_s64(delta * clk_corr.drift_ppb, NSEC_PER_SEC);
+}
+
+/* IEP time of a system time. Must be called with clk_lock held. */
+static u64 dev_sys_to_iep_locked (u64 sys) {
+
+	s64 delta = sys - clk_corr.sys_ref_ns;
+
+	return clk_corr.iep_ref + delta - div_s64(delta * clk_corr.drift_ppb, NSEC_PER_SEC + clk_corr.drift_ppb);
+}
+
+/* Samples the IEP counter between two reads of the system clock, keeping the
+ * narrowest window out of CORR_READS, and feeds the servo: the system time at
+ * the sample is predicted from the current estimate, half of the error is
+ * corrected right away and a quarter of it, over the sampling period, goes
+ * into the drift. Large errors step the estimate. */
+static void dev_clk_work (struct work_struct *work) {
+
+	void __iomem *iep = dev_iep();
+	u64 t0, t1, best_sys = 0, best_iep = 0;
+	u32 best_win = U32_MAX, best_raw = 0, raw, cfg;
+	unsigned long flags;
+	s64 error, diep;
+	int i;
+
+	if (!iep)
+		goto out;
+
+	/* Nothing to sample while the firmware keeps the IEP stopped. Counts
+	 * are scaled by the increment it runs with. */
+	cfg = ioread32(iep + IEP_GLOBAL_CFG);
+	if (!(cfg & IEP_CNT_ENABLE) || !IEP_DEFAULT_INC(cfg))
+		goto out;
+
+	spin_lock_irqsave(&clk_lock, flags);
+
+	iep_inc = IEP_DEFAULT_INC(cfg);
+
+	for (i = 0; i < CORR_READS; i++) {
+
+		t0 = ktime_get_ns();
+		raw = ioread32(iep + IEP_COUNT);
+		t1 = ktime_get_ns();
+
+		if (t1 - t0 < best_win) {
+			best_win = t1 - t0;
+			best_sys = t0 + best_win / 2;
+			best_iep = dev_iep_extend_locked(raw);
+			best_raw = raw;
+		}
+		else
+			dev_iep_extend_locked(raw);
+	}
+
+	clk_corr.uncertainty_ns = best_win;
+	clk_corr.samples++;
+
+	diep = best_iep - clk_corr.iep_ref;
+
+	if (clk_corr.samples == 1) {
+		clk_corr.iep_ref = best_iep;
+		iep_ref_raw = best_raw;
+		clk_corr.sys_ref_ns = best_sys;
+		clk_corr.last_error_ns = 0;
+		spin_unlock_irqrestore(&clk_lock, flags);
+		goto out;
+	}
+
+	error = best_sys - dev_iep_to_sys_locked(best_iep);
+	clk_corr.last_error_ns = error;
+
+	if (abs(error) > CORR_STEP_NS || diep <= 0) {
+		clk_corr.sys_ref_ns = best_sys;
+		clk_good = 0;
+	}
+	else {
+		clk_corr.sys_ref_ns = best_sys - error / 2;
+		clk_corr.drift_ppb += div64_s64(error * (NSEC_PER_SEC / 4), diep);
+		clk_good = abs(error) < CORR_LOCK_NS ? clk_good + 1 : 0;
+	}
+
+	clk_corr.iep_ref = best_iep;
+	iep_ref_raw = best_raw;
+
+	if (clk_good >= CORR_LOCK_SAMPLES)
+		clk_corr.flags |= PRUSS_CORR_LOCKED;
+	else
+		clk_corr.flags &= ~PRUSS_CORR_LOCKED;
+
+	spin_unlock_irqrestore(&clk_lock, flags);
+
+out:
+	schedule_delayed_work(&clk_work, msecs_to_jiffies(CORR_PERIOD_MS));
+}
+
+static int dev_get_clock_corr (unsigned long arg) {
+
+	struct pruss_clock_corr corr;
+
+	spin_lock_irq(&clk_lock);
+	corr = clk_corr;
+	spin_unlock_irq(&clk_lock);
+
+	return copy_to_user((void __user *) arg, &corr, sizeof(corr)) ? -EFAULT : 0;
+}
+
+/* Converts between IEP and system times with the current estimate */
+static int dev_time_conv (unsigned long arg, bool to_sys) {
+
+	struct pruss_time_conv conv;
+
+	if (copy_from_user(&conv, (void __user *) arg, sizeof(conv)))
+		return -EFAULT;
+
+	if (conv.flags & ~PRUSS_CONV_RAW32)
+		return -EINVAL;
+
+	spin_lock_irq(&clk_lock);
+
+	if (clk_corr.samples < 2) {
+		spin_unlock_irq(&clk_lock);
+		return -EAGAIN;
+	}
+
+	if (to_sys) {
+		if (conv.flags & PRUSS_CONV_RAW32)
+			conv.iep_ns = dev_iep_unwrap_locked(conv.iep_ns);
+		conv.sys_ns = dev_iep_to_sys_locked(conv.iep_ns);
+	}
+	else {
+		conv.iep_ns = dev_sys_to_iep_locked(conv.sys_ns);
+		if (conv.flags & PRUSS_CONV_RAW32)
+			conv.iep_ns = dev_iep_wrap_locked(conv.iep_ns);
+	}
+
+	spin_unlock_irq(&clk_lock);
+
+	return copy_to_user((void __user *) arg, &conv, sizeof(conv)) ? -EFAULT : 0;
+}
+
+/* Builds a sync step command into its slot. If it is the one loaded, it is
+ * loaded again, after the next pulse while sync runs and pulses are timed. */
+static int dev_set_sync_step_slot (void __iomem *p, unsigned long arg) {
+
+	struct pruss_sync_step step;
+	u8 frame[SYNC_STEP_LEN];
+	u8 i, sum = 0;
+
+	/* Length byte, address, command, size and checksum around the payload */
+	BUILD_BUG_ON(SYNC_STEP_PAYLOAD_MAX != SYNC_STEP_LEN - 6);
+
+	if (copy_from_user(&step, (void __user *) arg, sizeof(step)))
+		return -EFAULT;
+
+	if (step.slot >= SYNC_STEP_SLOTS || step.len > SYNC_STEP_PAYLOAD_MAX)
+		return -EINVAL;
+
+	frame[0] = step.len + 5;
+	frame[1] = step.addr;
+	frame[2] = step.cmd;
+	frame[3] = 0;
+	frame[4] = step.len;
+	memcpy(frame + 5, step.payload, step.len);
+
+	for (i = 1; i < step.len + 5; i++)
+		sum += frame[i];
+	frame[step.len + 5] = -sum;
+
+	spin_lock_irq(&sync_lock);
+	memcpy(sync_steps[step.slot], frame, step.len + 6);
+	if (step.slot == sync_step_cur) {
+		/* Rotating slots are loaded after each pulse anyway */
+		if (!(sync_state & PRUSS_SYNC_RUNNING) || !dev_sync_timed())
+			dev_load_sync_step(p, sync_steps[sync_step_cur]);
+		else if (sync_step_count == 1)
+			sync_step_pending = true;
+	}
+	spin_unlock_irq(&sync_lock);
+
+	return 0;
+}
+
+/* Selects the sync step commands sent at the next pulses. While sync runs,
+ * the first one is loaded right after a pulse, between two sync commands, if
+ * pulses are timed; otherwise it is loaded at once and only it is sent. */
+static int dev_select_sync_step (void __iomem *p, unsigned long arg) {
+
+	struct pruss_sync_step_sel sel;
+	u8 i;
+
+	if (copy_from_user(&sel, (void __user *) arg, sizeof(sel)))
+		return -EFAULT;
+
+	if (!sel.count || sel.first + sel.count > SYNC_STEP_SLOTS)
+		return -EINVAL;
+
+	spin_lock_irq(&sync_lock);
+
+	for (i = sel.first; i < sel.first + sel.count; i++)
+		if (!sync_steps[i][0]) {
+			spin_unlock_irq(&sync_lock);
+			return -EINVAL;
+		}
+
+	sync_step_first = sel.first;
+	sync_step_count = sel.count;
+	if ((sync_state & PRUSS_SYNC_RUNNING) && dev_sync_timed())
+		sync_step_pending = true;
+	else {
+		sync_step_cur = sel.first;
+		dev_load_sync_step(p, sync_steps[sync_step_cur]);
+	}
+	spin_unlock_irq(&sync_lock);
+
+	return 0;
+}
+
+/* Sets the answer timeout, in ms */
+static void dev_set_timeout (void __iomem *p, unsigned long arg) {
+
+	timeout_ms = arg;
+	arg = arg * 66600;
+
+	iowrite8(arg & 0xff, p + TIMEOUT_OFFSET);
+	iowrite8((arg >> 8) & 0xff, p + TIMEOUT_OFFSET + 1);
+	iowrite8((arg >> 16) & 0xff, p + TIMEOUT_OFFSET + 2);
+	iowrite8((arg >> 24) & 0xff, p + TIMEOUT_OFFSET + 3);
+}
+
+/* Writes the staged configuration. Must be called with sync_lock held. */
+static void dev_apply_staged_locked (void __iomem *p) {
+
+	struct pruss_staged_config *cfg = &sync_staged;
+
+	if (!cfg->flags)
+		return;
+
+	if (cfg->flags & PRUSS_STAGE_BAUD)
+		dev_config_baudrate(p, cfg->baudrate);
+
+	if (cfg->flags & PRUSS_STAGE_TIMEOUT)
+		dev_set_timeout(p, cfg->timeout_ms);
+
+	if (cfg->flags & PRUSS_STAGE_COUNTER) {
+		dev_set_sync_counter(p, cfg->counter);
+		sync_raw = cfg->counter;
+		sync_count = sync_count_base + cfg->counter;
+	}
+
+	if (cfg->flags & PRUSS_STAGE_SYNC_STEP) {
+		sync_step_first = sync_step_cur = cfg->sync_step;
+		sync_step_count = 1;
+		sync_step_pending = false;
+		dev_load_sync_step(p, sync_steps[sync_step_cur]);
+	}
+
+	cfg->flags = 0;
+	sync_staged_seq++;
+}
+
+/* Stages a configuration, merged with the one already staged */
+static int dev_stage_config (void __iomem *p, unsigned long arg) {
+
+	struct pruss_staged_config cfg;
+	u32 seq;
+
+	if (copy_from_user(&cfg, (void __user *) arg, sizeof(cfg)))
+		return -EFAULT;
+
+	if (cfg.flags & ~(PRUSS_STAGE_BAUD | PRUSS_STAGE_TIMEOUT | PRUSS_STAGE_COUNTER |
+			PRUSS_STAGE_SYNC_STEP | PRUSS_STAGE_WAIT))
+		return -EINVAL;
+
+	if ((cfg.flags & PRUSS_STAGE_BAUD) && dev_config_baudrate(NULL, cfg.baudrate))
+		return -EINVAL;
+
+	if ((cfg.flags & PRUSS_STAGE_SYNC_STEP) && cfg.sync_step >= SYNC_STEP_SLOTS)
+		return -EINVAL;
+
+	spin_lock_irq(&sync_lock);
+
+	if ((cfg.flags & PRUSS_STAGE_SYNC_STEP) && !sync_steps[cfg.sync_step][0]) {
+		spin_unlock_irq(&sync_lock);
+		return -EINVAL;
+	}
+
+	if (cfg.flags & PRUSS_STAGE_BAUD)
+		sync_staged.baudrate = cfg.baudrate;
+	if (cfg.flags & PRUSS_STAGE_TIMEOUT)
+		sync_staged.timeout_ms = cfg.timeout_ms;
+	if (cfg.flags & PRUSS_STAGE_COUNTER)
+		sync_staged.counter = cfg.counter;
+	if (cfg.flags & PRUSS_STAGE_SYNC_STEP)
+		sync_staged.sync_step = cfg.sync_step;
+	sync_staged.flags |= cfg.flags & ~PRUSS_STAGE_WAIT;
+
+	/* Without the sync pulse event, no pulse would ever write it */
+	seq = sync_staged_seq;
+	if (!(sync_state & PRUSS_SYNC_RUNNING) || !dev_sync_timed()) {
+		dev_apply_staged_locked(p);
+		dev_sync_publish_locked();
+	}
+
+	spin_unlock_irq(&sync_lock);
+
+	if ((cfg.flags & PRUSS_STAGE_WAIT) &&
+			wait_event_interruptible(sync_wait, READ_ONCE(sync_staged_seq) != seq))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+
+static int dev_set_delay_calib (unsigned long arg) {
+
+	struct pruss_delay_calib calib;
+
+	if (copy_from_user(&calib, (void __user *) arg, sizeof(calib)))
+		return -EFAULT;
+
+	if (!calib.loop_ps || calib.loop_ps > DELAY_LOOP_PS_MAX || calib.overhead_ns > DELAY_OVERHEAD_NS_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&sync_lock);
+	delay_calib = calib;
+	spin_unlock_irq(&sync_lock);
+
+	return 0;
+}
+
+/* Signals the eventfd of the files notified at this pulse. Must be called with
+ * sync_lock held. */
+static void dev_sync_notify_locked (void) {
+
+	struct pruss_client *client;
+	u64 pulse = sync_count - sync_count_base;
+	u32 rem;
+
+	list_for_each_entry(client, &sync_clients, sync_node) {
+
+		div_u64_rem(pulse, client->sync_every, &rem);
+		if (!rem)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+			eventfd_signal(client->sync_efd);
+#else
+			eventfd_signal(client->sync_efd, 1);
+#endif
+	}
+}
+
+/* Sets the pulse divider of the file and the eventfd it is notified through */
+static int dev_set_sync_notify (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_sync_notify notify;
+	struct eventfd_ctx *efd = NULL, *old;
+
+	if (copy_from_user(&notify, (void __user *) arg, sizeof(notify)))
+		return -EFAULT;
+
+	if (!notify.every)
+		return -EINVAL;
+
+	if (notify.eventfd >= 0) {
+		efd = eventfd_ctx_fdget(notify.eventfd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	spin_lock_irq(&sync_lock);
+	old = client->sync_efd;
+	if (old)
+		list_del(&client->sync_node);
+	client->sync_efd = efd;
+	client->sync_every = notify.every;
+	if (efd)
+		list_add_tail(&client->sync_node, &sync_clients);
+	spin_unlock_irq(&sync_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/* Whether a pulse multiple of every came after *pulse. If so, *pulse and *ts
+ * are updated with the last one. */
+static bool dev_sync_reached (u32 every, u64 *pulse, ktime_t *ts) {
+
+	unsigned long flags;
+	bool reached;
+	u64 count;
+
+	spin_lock_irqsave(&sync_lock, flags);
+	count = sync_count - sync_count_base;
+	reached = count != *pulse && div_u64(count, every) != div_u64(*pulse, every);
+	if (reached) {
+		*pulse = count;
+		*ts = sync_last;
+	}
+	spin_unlock_irqrestore(&sync_lock, flags);
+
+	return reached;
+}
+
+/* Sleeps until the next pulse multiple of the file divider */
+static int dev_sync_wait (struct pruss_client *client, unsigned long arg) {
+
+	struct pruss_sync_event event;
+	ktime_t ts = 0;
+	u64 pulse;
+
+	spin_lock_irq(&sync_lock);
+	pulse = sync_count - sync_count_base;
+	spin_unlock_irq(&sync_lock);
+
+	if (wait_event_interruptible(sync_wait, dev_sync_reached(client->sync_every, &pulse, &ts)))
+		return -ERESTARTSYS;
+
+	event.pulse = pulse;
+	event.ts_ns = ktime_to_ns(ts);
+
+	return copy_to_user((void __user *) arg, &event, sizeof(event)) ? -EFAULT : 0;
+}
+
+/* Called by pruss_handler() on sync_evtout, at each sync pulse. The period
+ * is measured between pulses, and a transaction waiting for its TDMA slot or
+ * sync window is placed again from this pulse. */
+static void dev_sync_irq (struct uio_pruss_dev *gdev) {
+
+	void __iomem *intrc = gdev->prussio_vaddr + gdev->pintc_base;
+	void __iomem *p = gdev->prussio_vaddr + PRUSS_SHAREDRAM_BASE;
+	ktime_t now = ktime_get();
+	u16 counter = ioread16(p + COUNTER_OFFSET);
+
+	/* The host interruption is kept enabled, only the event is cleared */
+	iowrite32(sync_sysevt, intrc + PINTC_SICR);
+
+	spin_lock(&sync_lock);
+	if (sync_pulses) {
+		sync_period_ns = ktime_to_ns(ktime_sub(now, sync_last));
+		dev_sync_stats_add_locked(sync_period_ns);
+	}
+	sync_last = now;
+	sync_pulses++;
+	dev_sync_extend_locked(counter);
+
+	/* The command of this pulse was sent: the next one can be loaded */
+	if (sync_step_pending || sync_step_count > 1) {
+		sync_step_cur = sync_step_pending ? sync_step_first :
+				sync_step_first + (sync_step_cur - sync_step_first + 1) % sync_step_count;
+		sync_step_pending = false;
+		dev_load_sync_step(p, sync_steps[sync_step_cur]);
+	}
+
+	/* So can the staged configuration */
+	dev_apply_staged_locked(p);
+
+	dev_sync_publish_locked();
+	dev_sync_notify_locked();
+	spin_unlock(&sync_lock);
+
+	wake_up_all(&sync_wait);
+
+	dev_xfer_replace(p);
+}
+
+/* Called by pruss_handler() on PRU_EVTOUT. In slave mode, received frames are
+ * checked against the address filter, answered from the reply cache or the
+ * register table if possible or else checked against the attached BPF program,
+ * before any task is woken up. Dropped frames are given back to the PRU
+ * straight away. Returns true if the event was completely served. */
+static bool dev_irq_event (struct uio_pruss_dev *gdev) {
+
+	void __iomem *p = gdev->prussio_vaddr + PRUSS_SHAREDRAM_BASE;
+	const struct pruss_reply *reply;
+	bool accept, answered = false;
+	u32 count, resp_len;
+
+	/* End of a transmission started by the driver itself */
+	if (READ_ONCE(tx_kernel)) {
+
+		spin_lock(&rx_lock);
+		tx_kernel = false;
+		spin_unlock(&rx_lock);
+
+		wake_up(&tx_wait);
+		dev_intc_rearm(gdev->prussio_vaddr + gdev->pintc_base);
+		return true;
+	}
+
+	/* Master transaction driven by the driver, or the late end of an
+	 * abandoned one */
+	if (READ_ONCE(xfer_active) || READ_ONCE(xfer_quiet)) {
+
+		dev_xfer_irq(p);
+		dev_intc_rearm(gdev->prussio_vaddr + gdev->pintc_base);
+		return true;
+	}
+
+	if (tx_pending || ioread8(p + MODE_OFFSET) != 'S' ||
+			ioread8(p + STATUS_OFFSET) != NEW_RECEIVED_MESSAGE)
+		return false;
+
+	count = dev_rx_length(p);
+
+	spin_lock(&rx_lock);
+	accept = count && dev_addr_filter_match(ioread8(p + SHRAM_READ_OFFSET + 4));
+	if (count) {
+
+		struct pruss_rx_prog *prog;
+		struct pruss_rx_frame *frame = rx_spare;
+
+		frame->seq = 0;
+		smp_wmb();
+		memcpy_fromio(frame->data, p + SHRAM_READ_OFFSET + 4, count);
+
+		/* Every frame is recorded, whatever the filters decide */
+		dev_tap_frame(MON_INBOUND, frame->data, count, dev_rx_length_raw(p));
+
+		if (!accept)
+			goto out;
+
+		/* Known requests are answered here and never reach the readers */
+		if (!tx_pending) {
+
+			reply = dev_reply_lookup(frame->data, count);
+			if (reply) {
+				dev_load_tx(p, reply->resp, reply->resp_len);
+				dev_tap_frame(MON_OUTBOUND, reply->resp, reply->resp_len, reply->resp_len);
+				answered = true;
+			}
+			else if ((resp_len = dev_regmap_serve(frame->data, count))) {
+				dev_load_tx(p, regmap_resp, resp_len);
+				dev_tap_frame(MON_OUTBOUND, regmap_resp, resp_len, resp_len);
+				answered = true;
+			}
+
+			if (answered) {
+				tx_kernel = true;
+				accept = false;
+				goto out;
+			}
+		}
+
+		rcu_read_lock();
+		prog = rcu_dereference(rx_prog);
+		if (prog)
+			count = min_t(u32, count, dev_bpf_run(prog, frame->data, count));
+		rcu_read_unlock();
+
+		accept = count;
+		if (accept) {
+
+			/* Publishes the frame. The one it replaces becomes the spare */
+			frame->len = count;
+			smp_wmb();
+			frame->seq = rx_head + 1;
+			rx_spare = rx_ring[rx_head & (rx_ring_sz - 1)];
+			WRITE_ONCE(rx_ring[rx_head & (rx_ring_sz - 1)], frame);
+			smp_wmb();
+			WRITE_ONCE(rx_head, rx_head + 1);
+		}
+	}
+out:
+	spin_unlock(&rx_lock);
+
+	/* The frame was copied, so the buffer goes back to the PRU in any case,
+	 * possibly along with the answer to it */
+	iowrite8(answered ? MESSAGE_TO_SEND : OLD_MESSAGE, p + STATUS_OFFSET);
+
+	if (accept)
+		wake_up_interruptible(&rx_wait);
+
+	dev_intc_rearm(gdev->prussio_vaddr + gdev->pintc_base);
+
+	return true;
+}
+
+/* Whether slave writers of a more urgent class than prio are waiting */
+static bool dev_tx_outranked (u8 prio) {
+
+	bool outranked = false;
+	u8 i;
+
+	spin_lock_irq(&rx_lock);
+	for (i = 0; i < prio; i++)
+		outranked |= tx_waiters[i] != 0;
+	spin_unlock_irq(&rx_lock);
+
+	return outranked;
+}
+
+/* Takes pruchar_mutex for a slave writer of class prio, letting the writers
+ * of more urgent classes go first */
+static int dev_tx_lock (u8 prio) {
+
+	int err = 0;
+
+	spin_lock_irq(&rx_lock);
+	tx_waiters[prio]++;
+	spin_unlock_irq(&rx_lock);
+
+	for (;;) {
+
+		if (mutex_lock_interruptible(&pruchar_mutex)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+
+		if (!dev_tx_outranked(prio))
+			break;
+
+		mutex_unlock(&pruchar_mutex);
+
+		if (wait_event_interruptible(tx_wait, !dev_tx_outranked(prio))) {
+			err = -ERESTARTSYS;
+			break;
+		}
+	}
+
+	spin_lock_irq(&rx_lock);
+	tx_waiters[prio]--;
+	spin_unlock_irq(&rx_lock);
+
+	wake_up(&tx_wait);
+
+	return err;
+}
+
+/* Copies the next frame of the reception ring to a reader. Readers which fall
+ * more than rx_ring_sz frames behind skip the lost ones and account for them
+ * in rx_overflow. The reader's own filter, if any, runs on the shared copy. */
+static ssize_t dev_rx_read (struct file *filep, struct iov_iter *to, bool nonblock) {
+
+	struct pruss_client *client = filep->private_data;
+	size_t len = iov_iter_count(to);
+
+	for (;;) {
+
+		struct pruss_rx_frame *frame;
+		struct pruss_rx_prog *prog;
+		u32 head, seq, count;
+		bool copied = false;
+
+		if (nonblock) {
+			if (READ_ONCE(client->rx_cursor) == READ_ONCE(rx_head))
+				return -EAGAIN;
+		}
+		else if (wait_event_interruptible(rx_wait, READ_ONCE(client->rx_cursor) != READ_ONCE(rx_head)))
+			return -ERESTARTSYS;
+
+		/* Readers of the same file share its cursor */
+		if (nonblock) {
+			if (!mutex_trylock(&client->lock))
+				return -EAGAIN;
+		}
+		else if (mutex_lock_interruptible(&client->lock))
+			return -ERESTARTSYS;
+
+		head = READ_ONCE(rx_head);
+		smp_rmb();
+
+		/* Another reader took the frame */
+		if (client->rx_cursor == head) {
+			mutex_unlock(&client->lock);
+			if (nonblock)
+				return -EAGAIN;
+			continue;
+		}
+
+		if (head - client->rx_cursor > rx_ring_sz) {
+			client->rx_overflow += head - client->rx_cursor - rx_ring_sz;
+			client->rx_cursor = head - rx_ring_sz;
+		}
+
+		frame = READ_ONCE(rx_ring[client->rx_cursor & (rx_ring_sz - 1)]);
+		seq = READ_ONCE(frame->seq);
+		smp_rmb();
+		count = min_t(u32, frame->len, len);
+
+		if (seq == client->rx_cursor + 1) {
+
+			rcu_read_lock();
+			prog = rcu_dereference(client->rx_prog);
+			if (prog)
+				count = min_t(u32, count, dev_bpf_run(prog, frame->data, frame->len));
+			rcu_read_unlock();
+
+			if (count && copy_to_iter(frame->data, count, to) != count) {
+				mutex_unlock(&client->lock);
+				return -EFAULT;
+			}
+			copied = count;
+
+			smp_rmb();
+		}
+
+		/* Frame was overwritten while it was being read: what was copied
+		 * is given back */
+		if (READ_ONCE(frame->seq) != client->rx_cursor + 1) {
+			if (copied)
+				iov_iter_revert(to, count);
+			client->rx_overflow++;
+			client->rx_cursor++;
+			mutex_unlock(&client->lock);
+			continue;
+		}
+
+		client->rx_cursor++;
+		mutex_unlock(&client->lock);
+
+		if (count)
+			return count;
+	}
+}
+
+/* Allocates the reception ring and its spare frame */
+static int dev_rx_ring_init (void) {
+
+	int i;
+
+	if (rx_ring_sz < 2)
+		rx_ring_sz = 2;
+	rx_ring_sz = roundup_pow_of_two(rx_ring_sz);
+
+	rx_ring = kcalloc(rx_ring_sz, sizeof(*rx_ring), GFP_KERNEL);
+	rx_frames = vzalloc((rx_ring_sz + 1) * sizeof(*rx_frames));
+	if (!rx_ring || !rx_frames) {
+		kfree(rx_ring);
+		vfree(rx_frames);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < rx_ring_sz; i++)
+		rx_ring[i] = &rx_frames[i];
+	rx_spare = &rx_frames[rx_ring_sz];
+
+	return 0;
+}
+
+static void dev_rx_ring_cleanup (void) {
+
+	kfree(rx_ring);
+	vfree(rx_frames);
+	vfree(poll_results);
+	free_page((unsigned long) sync_page);
+}
+
+/* Opens the bus monitor. Only one capture can run at a time, in a buffer of
+ * its own: the external ram pool belongs to user space and the PRU. */
+static int mon_open (struct inode *inodep, struct file *filep) {
+
+	u32 size = dev_mon_region_size();
+	u8 *buf;
+
+	if (!size)
+		return -EINVAL;
+
+	if (atomic_inc_return(&mon_users) != 1) {
+		atomic_dec(&mon_users);
+		return -EBUSY;
+	}
+
+	buf = vmalloc(size);
+	if (!buf) {
+		atomic_dec(&mon_users);
+		return -ENOMEM;
+	}
+
+	spin_lock_irq(&mon_lock);
+	mon_size = size;
+	mon_buf = buf;
+	mon_head = mon_tail = mon_drops = mon_hdr_off = 0;
+	WRITE_ONCE(mon_active, true);
+	spin_unlock_irq(&mon_lock);
+
+	return 0;
+}
+
+static int mon_release (struct inode *inodep, struct file *filep) {
+
+	spin_lock_irq(&mon_lock);
+	WRITE_ONCE(mon_active, false);
+	spin_unlock_irq(&mon_lock);
+
+	/* No frame is appended anymore once mon_active is cleared under mon_lock */
+	vfree(mon_buf);
+	mon_buf = NULL;
+
+	atomic_dec(&mon_users);
+
+	return 0;
+}
+
+/* Streams the capture: the section header and interface description blocks
+ * first, then the packet blocks as they are appended to the ring. Must be
+ * called with mon_read_mutex held. */
+static ssize_t mon_read_locked (struct file *filep, char __user *buffer, size_t len) {
+
+	struct {
+		struct pcapng_shb shb;
+		struct pcapng_idb idb;
+	} __packed hdr = {
+		.shb = {
+			.type = PCAPNG_SHB,
+			.total_len = sizeof(struct pcapng_shb),
+			.magic = PCAPNG_BYTE_ORDER_MAGIC,
+			.major = 1,
+			.minor = 0,
+			.section_len = (u64) -1,
+			.total_len_end = sizeof(struct pcapng_shb),
+		},
+		.idb = {
+			.type = PCAPNG_IDB,
+			.total_len = sizeof(struct pcapng_idb),
+			.link_type = PCAPNG_LINKTYPE_USER0,
+			.snap_len = RX_FRAME_MAX,
+			.tsresol_code = PCAPNG_OPT_TSRESOL,
+			.tsresol_len = 1,
+			.tsresol = 9,
+			.total_len_end = sizeof(struct pcapng_idb),
+		},
+	};
+	u32 head, tail, count, first;
+
+	if (mon_hdr_off < sizeof(hdr)) {
+
+		count = min_t(u32, len, sizeof(hdr) - mon_hdr_off);
+		if (copy_to_user(buffer, (u8 *) &hdr + mon_hdr_off, count))
+			return -EFAULT;
+
+		mon_hdr_off += count;
+		return count;
+	}
+
+	if (filep->f_flags & O_NONBLOCK) {
+		if (READ_ONCE(mon_head) == mon_tail)
+			return -EAGAIN;
+	}
+	else if (wait_event_interruptible(mon_wait, READ_ONCE(mon_head) != mon_tail))
+		return -ERESTARTSYS;
+
+	head = READ_ONCE(mon_head);
+	smp_rmb();
+
+	/* Blocks below head are complete and are not overwritten until tail moves */
+	tail = mon_tail;
+	count = min_t(u32, len, head - tail);
+	first = min_t(u32, count, mon_size - (tail & (mon_size - 1)));
+
+	if (copy_to_user(buffer, mon_buf + (tail & (mon_size - 1)), first) ||
+			copy_to_user(buffer + first, mon_buf, count - first))
+		return -EFAULT;
+
+	spin_lock_irq(&mon_lock);
+	mon_tail += count;
+	spin_unlock_irq(&mon_lock);
+
+	return count;
+}
+
+/* Threads reading the same capture take turns, so the stream is not mixed up */
+static ssize_t mon_read (struct file *filep, char __user *buffer, size_t len, loff_t *offset) {
+
+	ssize_t ret;
+
+	if (filep->f_flags & O_NONBLOCK) {
+		if (!mutex_trylock(&mon_read_mutex))
+			return -EAGAIN;
+	}
+	else if (mutex_lock_interruptible(&mon_read_mutex))
+		return -ERESTARTSYS;
+
+	ret = mon_read_locked(filep, buffer, len);
+	mutex_unlock(&mon_read_mutex);
+
+	return ret;
+}
+
+static unsigned int mon_poll (struct file *filep, poll_table *wait) {
+
+	poll_wait(filep, &mon_wait, wait);
+
+	if (mon_hdr_off < sizeof(struct pcapng_shb) + sizeof(struct pcapng_idb) ||
+			READ_ONCE(mon_head) != mon_tail)
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static long mon_unlocked_ioctl (struct file *filep, unsigned int cmd, unsigned long arg) {
+
+	switch (cmd) {
+
+	case PRUSS_MON_GET_DROPS:
+
+		return put_user(READ_ONCE(mon_drops), (u32 __user *) arg);
+	}
+
+	return -EINVAL;
+}
+
+/* Initialization procedure of the character device. Initializes mutexes and registers the device */
+static int __init pru_driver_init(void) {
+
+	printk(KERN_INFO "PRU KVM: initializing module.\n");
+
+	/* Sync pulses are timed only with a valid event and host interruption.
+	 * PRU_EVTOUT is served by dev_irq_event() before any sync pulse. */
+	if ((sync_sysevt >= 0 || sync_evtout >= 0) &&
+			(sync_sysevt < 0 || sync_sysevt > 63 || sync_evtout < 2 || sync_evtout > 9 ||
+			 sync_evtout == PRU_EVTOUT)) {
+		printk(KERN_ALERT "PRU KVM: invalid sync_sysevt/sync_evtout, sync pulses are not timed.\n");
+		sync_sysevt = sync_evtout = -1;
+	}
+
+	if (dev_rx_ring_init()) {
+
+		printk(KERN_ALERT "PRU KVM: failed to allocate the reception ring.\n");
+		return -ENOMEM;
+	}
+
+	poll_results = vmalloc_user(PAGE_ALIGN(POLL_ENTRIES_MAX * sizeof(*poll_results)));
+	if (!poll_results) {
+
+		dev_rx_ring_cleanup();
+		printk(KERN_ALERT "PRU KVM: failed to allocate the poll result table.\n");
+		return -ENOMEM;
+	}
+
+	sync_page = (struct pruss_sync_page *) get_zeroed_page(GFP_KERNEL);
+	if (!sync_page) {
+
+		dev_rx_ring_cleanup();
+		printk(KERN_ALERT "PRU KVM: failed to allocate the sync page.\n");
+		return -ENOMEM;
+	}
+
+	hrtimer_init(&xfer_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	xfer_timer.function = dev_xfer_timer;
+	memcpy(poll_flow.comm, "poll", sizeof("poll"));
+	dev_flow_init(&poll_flow, 0);
+	hrtimer_init(&poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	poll_timer.function = dev_poll_timer;
+
+	/* Registering pruss_driver */
+	platform_driver_register(&pruss_driver);
+	_pdev_c = 0;
+
+	mutex_init(&pruchar_mutex);
+
+	majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
+	if (majorNumber < 0) {
+
+		dev_rx_ring_cleanup();
+		printk(KERN_ALERT "PRU KVM: failed to register a major number.\n");
+		return majorNumber;
+	}
+	printk(KERN_INFO "PRU KVM: registered correctly with major number %d\n", majorNumber);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	prucharClass = class_create(CLASS_NAME);
+#else
+	prucharClass = class_create(THIS_MODULE, CLASS_NAME);
+#endif
+	if (IS_ERR(prucharClass)) {
+
+		unregister_chrdev(majorNumber, DEVICE_NAME);
+		dev_rx_ring_cleanup();
+		printk(KERN_ALERT "PRU KVM: failed to register device class.\n");
+		return PTR_ERR(prucharClass);
+	}
+	printk(KERN_INFO "PRU KVM: device class registered correctly\n");
+
+	prucharDevice = device_create(prucharClass, NULL, MKDEV(majorNumber, PRUSS_MINOR), NULL, DEVICE_NAME);
+	if (IS_ERR(prucharDevice)){
+
+		mutex_destroy(&pruchar_mutex);
+		class_destroy(prucharClass);
+		unregister_chrdev(majorNumber, DEVICE_NAME);
+		dev_rx_ring_cleanup();
+		printk(KERN_ALERT "PRU KVM: Failed to create the device\n");
+		return PTR_ERR(prucharDevice);
+	}
+
+	prucharMonDevice = device_create(prucharClass, NULL, MKDEV(majorNumber, PRUSS_MON_MINOR), NULL, MON_DEVICE_NAME);
+	if (IS_ERR(prucharMonDevice)){
+
+		device_destroy(prucharClass, MKDEV(majorNumber, PRUSS_MINOR));
+		mutex_destroy(&pruchar_mutex);
+		class_destroy(prucharClass);
+		unregister_chrdev(majorNumber, DEVICE_NAME);
+		dev_rx_ring_cleanup();
+		printk(KERN_ALERT "PRU KVM: Failed to create the monitor device\n");
+		return PTR_ERR(prucharMonDevice);
+	}
+
+	dev_trace_init();
+	if (device_create_bin_file(prucharDevice, &dev_attr_trace))
+		printk(KERN_ALERT "PRU KVM: failed to create the flight recorder attribute\n");
+
+	dev_reset_sync_stats();
+
+	INIT_DELAYED_WORK(&clk_work, dev_clk_work);
+	schedule_delayed_work(&clk_work, 0);
+
+	/* Not fatal: debugfs may be missing */
+	pruss_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+	debugfs_create_file("sync_stats", 0644, pruss_debugfs, NULL, &sync_stats_fops);
+	debugfs_create_file("clients", 0444, pruss_debugfs, NULL, &clients_fops);
+
+	printk(KERN_INFO "PRU KVM: device class created correctly\n");
+
+	return 0;
+}
+
+/* Exits device and releases all resources. */
+static void __exit pru_driver_exit(void) {
+
+	dev_stop_poll();
+	kfree(poll_list);
+	hrtimer_cancel(&xfer_timer);
+	cancel_delayed_work_sync(&clk_work);
+
+	platform_driver_unregister(&pruss_driver);
+
+	/* No interruption can use the program or the ring anymore */
+	kfree(rcu_dereference_protected(rx_prog, 1));
+	dev_rx_ring_cleanup();
+
+	if (regmap_page)
+		free_page((unsigned long) regmap_page);
+
+	mutex_destroy(&pruchar_mutex);
+
+	debugfs_remove_recursive(pruss_debugfs);
+	device_remove_bin_file(prucharDevice, &dev_attr_trace);
+	device_destroy(prucharClass, MKDEV(majorNumber, PRUSS_MON_MINOR));
+	device_destroy(prucharClass, MKDEV(majorNumber, PRUSS_MINOR));
+	class_unregister(prucharClass);
+	class_destroy(prucharClass);
+	unregister_chrdev(majorNumber, DEVICE_NAME);
+	dev_trace_cleanup();
+	printk(KERN_INFO "PRU KVM: module closed.\n");
+}
+
+/* Allocates the state of a new reader. Several processes may open the file:
+ * all of them see the received frames from this point on, and writes are
+ * serialized by pruchar_mutex. */
+static int dev_open(struct inode *inodep, struct file *filep){
+
+	struct pruss_client *client;
+
+	if (iminor(inodep) == PRUSS_MON_MINOR) {
+		filep->f_op = &mon_fops;
+		return mon_open(inodep, filep);
+	}
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	client->rx_cursor = READ_ONCE(rx_head);
+	client->sync_every = 1;
+	client->prio = PRUSS_PRIO_CYCLIC;
+	get_task_comm(client->flow.comm, current);
+	dev_flow_init(&client->flow, task_tgid_nr(current));
+	mutex_init(&client->lock);
+	spin_lock_init(&client->cq_lock);
+	INIT_LIST_HEAD(&client->cq);
+	INIT_LIST_HEAD(&client->answers);
+	init_waitqueue_head(&client->cq_wait);
+	filep->private_data = client;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	/* Reads and writes honour IOCB_NOWAIT */
+	filep->f_mode |= FMODE_NOWAIT;
+#endif
+
+	printk(KERN_INFO "PRU KVM: device has been opened.\n");
+	return 0;
+}
+
+/* Releases resources after a close() call */
+static int dev_release(struct inode *inodep, struct file *filep){
+
+	struct pruss_client *client = filep->private_data;
+	struct pruss_xfer *xfer, *tmp;
+	struct pruss_cmd *cmd;
+
+	/* No read or write can be running on this file anymore */
+	dev_ring_cleanup(client->ring);
+	dev_xfer_flush(client);
+	dev_flow_remove(&client->flow);
+	while ((cmd = dev_cq_pop(client)))
+		kfree(cmd);
+	list_for_each_entry_safe(xfer, tmp, &client->answers, node)
+		kfree(container_of(xfer, struct pruss_cmd, xfer));
+
+	if (client->sync_efd) {
+		spin_lock_irq(&sync_lock);
+		list_del(&client->sync_node);
+		spin_unlock_irq(&sync_lock);
+		eventfd_ctx_put(client->sync_efd);
+	}
+
+	kfree(rcu_dereference_protected(client->rx_prog, 1));
+	kfree(client->req);
+	kfree(client->resp);
+	mutex_destroy(&client->lock);
+	kfree(client);
+
+	printk(KERN_INFO "PRU KVM: device successfully closed.\n");
+	return 0;
+}
+
+/* Readable as soon as a frame was published after the reader's cursor, with
+ * POLLRDBAND once a tagged transaction completed */
+static unsigned int dev_poll (struct file *filep, poll_table *wait) {
+
+	struct pruss_client *client = filep->private_data;
+
+	unsigned int mask = 0;
+
+	poll_wait(filep, &rx_wait, wait);
+	poll_wait(filep, &regmap_wait, wait);
+	poll_wait(filep, &client->cq_wait, wait);
+
+	if (client->rx_cursor != READ_ONCE(rx_head))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (!list_empty_careful(&client->answers))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (!list_empty_careful(&client->cq))
+		mask |= POLLRDBAND;
+
+	if (client->ring && smp_load_acquire(&client->ring->hdr->cq_tail) != READ_ONCE(client->ring->hdr->cq_head))
+		mask |= POLLRDBAND;
+
+	if (!bitmap_empty(regmap_changed, REGMAP_VARS_MAX))
+		mask |= POLLPRI;
+
+	return mask;
+}
+
+/* Maps one of the tables shared with user space, selected by the page offset */
+/* Keeps a mapping read only, mprotect() included */
+static int dev_mmap_readonly (struct vm_area_struct *vma) {
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return 0;
+}
+
+static int dev_mmap (struct file *filep, struct vm_area_struct *vma) {
+
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int err;
+
+	switch (vma->vm_pgoff) {
+
+	case PRUSS_MMAP_REGMAP:
+
+		if (!regmap_page || size != PAGE_SIZE)
+			return -EINVAL;
+
+		return remap_pfn_range(vma, vma->vm_start, virt_to_phys(regmap_page) >> PAGE_SHIFT,
+				size, vma->vm_page_prot);
+
+	case PRUSS_MMAP_POLL:
+
+		/* Read only: results are published by the driver */
+		err = dev_mmap_readonly(vma);
+		if (err)
+			return err;
+
+		vma->vm_pgoff = 0;
+		return remap_vmalloc_range(vma, poll_results, 0);
+
+	case PRUSS_MMAP_RING:
+	{
+		struct pruss_client *client = filep->private_data;
+
+		err = -EINVAL;
+		mutex_lock(&client->lock);
+		if (client->ring && size == client->ring->size) {
+			vma->vm_pgoff = 0;
+			err = remap_vmalloc_range(vma, client->ring->area, 0);
+		}
+		mutex_unlock(&client->lock);
+
+		return err;
+	}
+
+	case PRUSS_MMAP_SYNC:
+
+		if (size != PAGE_SIZE)
+			return -EINVAL;
+
+		/* Read only: updated by the sync interruption */
+		err = dev_mmap_readonly(vma);
+		if (err)
+			return err;
+
+		return remap_pfn_range(vma, vma->vm_start, virt_to_phys(sync_page) >> PAGE_SHIFT,
+				size, vma->vm_page_prot);
+	}
+
+	return -EINVAL;
+}
+
+/* Reads the next received frame in slave mode or the answer to the last
+ * request in master mode. With IOCB_NOWAIT, io_uring retries once poll()
+ * reports the file readable. */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to){
+
+	struct file *filep = iocb->ki_filp;
+	bool nonblock = (filep->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	void __iomem *p = dev_shram();
+
+	if (!p)
+		return -EINVAL;
+
+	switch (ioread8(p + MODE_OFFSET)) {
+
+	case 'M':
+
+		/* Answers are fetched by the transaction which dev_write_iter() submitted */
+		return dev_xfer_read(filep->private_data, to, nonblock);
+
+	case 'S':
+
+		/* Frames are published by dev_irq_event() once they pass the filters */
+		return dev_rx_read(filep, to, nonblock);
+	}
+
+	return -EINVAL;
+}
+
+/* Writes into the shared memory area */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from){
+
+	struct file *filep = iocb->ki_filp;
+	ssize_t len = iov_iter_count(from);
+	long left;
+
+	if (_pdev) {
+
+		struct uio_pruss_dev *gdev = platform_get_drvdata(_pdev);
+
+		if (gdev) {
+
+			/* Mapped once by pruss_probe() */
+			void __iomem 	*p = dev_shram(),
+					*intrc = gdev->prussio_vaddr + gdev->pintc_base;
+
+			if (ioread8(p + MODE_OFFSET) == 'M')
+				return dev_xfer_write(filep->private_data, iocb, from);
+
+			/* The STATUS handshake always waits for the PRU */
+			if (iocb->ki_flags & IOCB_NOWAIT)
+				return -EAGAIN;
+
+			/* Only one writer can use the STATUS handshake at a time */
+			if (dev_tx_lock(dev_xfer_prio(filep->private_data, 0)))
+				return -ERESTARTSYS;
+
+			if (len > TX_FRAME_MAX || copy_from_iter(tx_frame, len, from) != len) {
+				mutex_unlock(&pruchar_mutex);
+				return len > TX_FRAME_MAX ? -EINVAL : -EFAULT;
+			}
+
+			/* Waits for any answer sent by the driver itself */
+			for (;;) {
+
+				spin_lock_irq(&rx_lock);
+				if (!tx_kernel) {
+					tx_pending = true;
+					tx_owner = filep->private_data;
+					tx_cancelled = false;
+					spin_unlock_irq(&rx_lock);
+					break;
+				}
+				spin_unlock_irq(&rx_lock);
+
+				if (wait_event_interruptible(tx_wait, !READ_ONCE(tx_kernel))) {
+					mutex_unlock(&pruchar_mutex);
+					return -ERESTARTSYS;
+				}
+			}
+
+			init_completion(&intr_completion);
+
+			dev_load_tx(p, tx_frame, len);
+			dev_tap_frame(MON_OUTBOUND, tx_frame, len, len);
+
+			iowrite8(MESSAGE_TO_SEND, p + STATUS_OFFSET);
+
+			/* Waits for an interruption to finish the writing cycle, unless
+			 * killed, past the deadline of the file or cancelled */
+			left = wait_for_completion_killable_timeout(&intr_completion,
+					dev_deadline(filep->private_data));
+
+			spin_lock_irq(&rx_lock);
+			tx_pending = false;
+			tx_owner = NULL;
+			if (left <= 0 || tx_cancelled) {
+				/* Takes the frame back, if the master did not ask for it yet */
+				iowrite8(OLD_MESSAGE, p + STATUS_OFFSET);
+				len = left < 0 ? -EINTR : left ? -ECANCELED : -ETIMEDOUT;
+			}
+			spin_unlock_irq(&rx_lock);
+
+			/* Clears system event and re-enables interruption */
+			dev_intc_rearm(intrc);
+
+			mutex_unlock(&pruchar_mutex);
+
+			return len;
+
+		}
+		else {
+			printk (KERN_INFO "gdev NULL \n");
+			return -EFAULT;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* ioctl() commands handler */
+static long dev_unlocked_ioctl (struct file *filep, unsigned int cmd, unsigned long arg) {
+
+	if (_pdev) {
+
+		u8 hw_addr;
+		struct pruss_client *client = filep->private_data;
+		struct uio_pruss_dev *gdev = platform_get_drvdata(_pdev);
+
+		if (gdev) {
+
+			/* Mapped once by pruss_probe() */
+			void __iomem *p = gdev->prussio_vaddr + PRUSS_SHAREDRAM_BASE;
+
+			switch (cmd) {
+
+			case PRUSS_MODE:
+
+				if (arg == 'M' || arg == 'S') {
+					iowrite8(arg, p + MODE_OFFSET);
+
+					dev_set_sync_stop(p);
+					dev_sync_set_running(false);
+
+					if (arg == 'S')
+						iowrite8(OLD_MESSAGE, p + STATUS_OFFSET);
+
+					return 0;
+				}
+				return -EINVAL;
+
+			case PRUSS_BAUDRATE:
+
+				return dev_config_baudrate(p, arg);
+
+			case PRUSS_CLEAN:
+
+				return dev_clean_sram(p);
+
+			case PRUSS_GET_HW_ADDRESS:
+
+				hw_addr = dev_get_hw_addr();
+				iowrite8(hw_addr, p + HW_ADDR_OFFSET);
+
+				spin_lock_irq(&rx_lock);
+				own_addr = hw_addr;
+				spin_unlock_irq(&rx_lock);
+
+				return 0;
+
+			case PRUSS_TIMEOUT:
+
+				dev_set_timeout(p, arg);
+				return 0;
+
+			case PRUSS_SET_SYNC_STEP:
+
+				return dev_set_sync_step(p);
+
+			case PRUSS_SET_PULSE_COUNT_SYNC:
+
+				dev_set_sync_counter(p, arg);
+				dev_sync_set_count(arg);
+				return 0;
+
+			case PRUSS_GET_PULSE_COUNT_SYNC:
+
+				return ioread16(p + COUNTER_OFFSET);
+
+			case PRUSS_CLEAR_PULSE_COUNT_SYNC:
+
+				if (dev_clear_count_sync(p))
+					return -1;
+
+				dev_sync_set_count(0);
+				return 0;
+
+			case PRUSS_START_SYNC:
+
+				if (dev_set_sync_start(arg, p))
+					return -1;
+
+				dev_sync_set_running(true);
+				return 0;
+
+			case PRUSS_STOP_SYNC:
+
+				if (dev_set_sync_stop(p))
+					return -1;
+
+				dev_sync_set_running(false);
+				return 0;
+
+			case PRUSS_SET_ADDR_FILTER:
+
+				return dev_set_addr_filter(p, arg);
+
+			case PRUSS_ATTACH_FILTER:
+
+				return arg ? dev_attach_filter(&rx_prog, arg) : -EINVAL;
+
+			case PRUSS_DETACH_FILTER:
+
+				return dev_attach_filter(&rx_prog, 0);
+
+			case PRUSS_ATTACH_CLIENT_FILTER:
+
+				return arg ? dev_attach_filter(&client->rx_prog, arg) : -EINVAL;
+
+			case PRUSS_DETACH_CLIENT_FILTER:
+
+				return dev_attach_filter(&client->rx_prog, 0);
+
+			case PRUSS_GET_RX_OVERFLOW:
+
+				return put_user(READ_ONCE(client->rx_overflow), (u32 __user *) arg);
+
+			case PRUSS_ADD_REPLY:
+
+				return dev_add_reply(arg);
+
+			case PRUSS_DEL_REPLY:
+
+				return dev_del_reply(arg);
+
+			case PRUSS_CLEAR_REPLIES:
+
+				return dev_del_reply(-1);
+
+			case PRUSS_SET_REGMAP:
+
+				return dev_set_regmap(arg);
+
+			case PRUSS_REGMAP_WAIT:
+
+				return dev_regmap_wait(filep, arg);
+
+			case PRUSS_SET_POLL_LIST:
+
+				return dev_set_poll_list(arg);
+
+			case PRUSS_START_POLL:
+
+				return dev_start_poll();
+
+			case PRUSS_STOP_POLL:
+
+				return dev_stop_poll();
+
+			case PRUSS_SEND_AT:
+
+				return dev_send_at(client, arg);
+
+			case PRUSS_SET_TDMA:
+
+				return dev_set_tdma(arg);
+
+			case PRUSS_GET_PULSE_COUNT64:
+
+				return dev_get_pulse_count64(p, arg);
+
+			case PRUSS_CLEAR_PULSE_COUNT64:
+
+				return dev_clear_pulse_count64(p);
+
+			case PRUSS_SET_SYNC_NOTIFY:
+
+				return dev_set_sync_notify(client, arg);
+
+			case PRUSS_SYNC_WAIT:
+
+				return dev_sync_wait(client, arg);
+
+			case PRUSS_SET_SYNC_PERIOD:
+
+				return dev_set_sync_period(arg);
+
+			case PRUSS_GET_SYNC_STATS:
+
+				return dev_get_sync_stats(arg);
+
+			case PRUSS_RESET_SYNC_STATS:
+
+				return dev_reset_sync_stats();
+
+			case PRUSS_GET_CLOCK_CORR:
+
+				return dev_get_clock_corr(arg);
+
+			case PRUSS_IEP_TO_SYS:
+
+				return dev_time_conv(arg, true);
+
+			case PRUSS_SYS_TO_IEP:
+
+				return dev_time_conv(arg, false);
+
+			case PRUSS_SET_DELAY_CALIB:
+
+				return dev_set_delay_calib(arg);
+
+			case PRUSS_GET_SYNC_DELAY:
+
+				return dev_get_sync_delay(arg);
+
+			case PRUSS_SET_SYNC_STEP_SLOT:
+
+				return dev_set_sync_step_slot(p, arg);
+
+			case PRUSS_SELECT_SYNC_STEP:
+
+				return dev_select_sync_step(p, arg);
+
+			case PRUSS_STAGE_CONFIG:
+
+				return dev_stage_config(p, arg);
+
+			case PRUSS_GET_SYNC_WINDOW:
+
+				return dev_get_sync_window(arg);
+
+			case PRUSS_SUBMIT:
+
+				return dev_submit(client, arg);
+
+			case PRUSS_REAP:
+
+				return dev_reap(client, arg);
+
+			case PRUSS_SETUP_RING:
+
+				return dev_setup_ring(client, arg);
+
+			case PRUSS_RING_ENTER:
+
+				return dev_ring_enter(client, arg);
+
+			case PRUSS_SET_DEADLINE:
+
+				WRITE_ONCE(client->deadline_ms, arg);
+				return 0;
+
+			case PRUSS_CANCEL:
+
+				return dev_cancel(client, arg);
+
+			case PRUSS_SET_PRIORITY:
+
+				if (arg >= PRUSS_PRIO_NR)
+					return -EINVAL;
+
+				WRITE_ONCE(client->prio, arg);
+				return 0;
+
+			case PRUSS_SET_WEIGHT:
+
+				return dev_set_weight(client, arg);
+
+			case PRUSS_GET_CLIENT_STATS:
 
-				return dev_set_sync_stop(p);
+				return dev_get_client_stats(client, arg);
 			}
 		}
 		else return -EFAULT;
@@ -7,23 +7,582 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <linux/filter.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "pruss485.h"
 
 #define SZ_12K 0x3000
 
-enum ioctl_cmd {
-	PRUSS_CLEAN = 10,
-	PRUSS_MODE,
-	PRUSS_SET_SYNC_STEP,
-	PRUSS_SET_PULSE_COUNT_SYNC,
-	PRUSS_GET_HW_ADDRESS,
-	PRUSS_BAUDRATE,
-	PRUSS_TIMEOUT,
-	PRUSS_GET_PULSE_COUNT_SYNC,
-	PRUSS_CLEAR_PULSE_COUNT_SYNC,
-	PRUSS_START_SYNC,
-	PRUSS_STOP_SYNC,
-};
+static int failures;
+
+/* Prints the outcome of a check and counts the failed ones */
+static void check (const char *what, int ok) {
+
+	printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failures++;
+}
+
+/* A call expected to be refused with err */
+#define FAILS(ret, err) ((ret) < 0 && errno == (err))
+
+static void test_addr_filter (int fd) {
+
+	struct pruss_addr_filter filter = {
+		.flags = ADDR_FILTER_ENABLE | ADDR_FILTER_OWN | ADDR_FILTER_BROADCAST,
+		.mask = 0xff,
+		.n_extra = 1,
+		.extra = { 0x10 },
+	};
+
+	ioctl(fd, PRUSS_MODE, 'S');
+
+	check("PRUSS_SET_ADDR_FILTER", !ioctl(fd, PRUSS_SET_ADDR_FILTER, &filter));
+
+	filter.n_extra = PRUSS_ADDR_FILTER_MAX + 1;
+	check("PRUSS_SET_ADDR_FILTER too many addresses",
+			FAILS(ioctl(fd, PRUSS_SET_ADDR_FILTER, &filter), EINVAL));
+
+	memset(&filter, 0, sizeof(filter));
+	check("PRUSS_SET_ADDR_FILTER disabled", !ioctl(fd, PRUSS_SET_ADDR_FILTER, &filter));
+
+	ioctl(fd, PRUSS_MODE, 'M');
+}
+
+static void test_bpf_filter (int fd) {
+
+	struct sock_filter accept[] = {
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+	};
+	struct sock_filter shift[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 32),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = { .len = 1, .filter = accept };
+
+	check("PRUSS_ATTACH_FILTER", !ioctl(fd, PRUSS_ATTACH_FILTER, &prog));
+	check("PRUSS_DETACH_FILTER", !ioctl(fd, PRUSS_DETACH_FILTER));
+	check("PRUSS_ATTACH_FILTER without a program", FAILS(ioctl(fd, PRUSS_ATTACH_FILTER, 0), EINVAL));
+
+	prog.len = 0;
+	check("PRUSS_ATTACH_FILTER empty program", FAILS(ioctl(fd, PRUSS_ATTACH_FILTER, &prog), EINVAL));
+
+	prog.len = 3;
+	prog.filter = shift;
+	check("PRUSS_ATTACH_FILTER shift by 32 bits", FAILS(ioctl(fd, PRUSS_ATTACH_FILTER, &prog), EINVAL));
+}
+
+static void test_readers (void) {
+
+	struct sock_filter accept[] = {
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+	};
+	struct sock_fprog prog = { .len = 1, .filter = accept };
+	uint32_t overflow = ~0;
+	int fd2;
+
+	/* Any number of files may be open at once */
+	fd2 = open("/dev/pruss485", O_RDWR);
+	check("second open of /dev/pruss485", fd2 >= 0);
+	if (fd2 < 0)
+		return;
+
+	check("PRUSS_GET_RX_OVERFLOW", !ioctl(fd2, PRUSS_GET_RX_OVERFLOW, &overflow) && !overflow);
+	check("PRUSS_ATTACH_CLIENT_FILTER", !ioctl(fd2, PRUSS_ATTACH_CLIENT_FILTER, &prog));
+	check("PRUSS_DETACH_CLIENT_FILTER", !ioctl(fd2, PRUSS_DETACH_CLIENT_FILTER));
+	check("PRUSS_ATTACH_CLIENT_FILTER without a program",
+			FAILS(ioctl(fd2, PRUSS_ATTACH_CLIENT_FILTER, 0), EINVAL));
+
+	close(fd2);
+}
+
+static void test_monitor (void) {
+
+	uint32_t block_type = 0, drops = ~0;
+	int mon;
+
+	mon = open("/dev/pruss485-mon", O_RDONLY | O_NONBLOCK);
+	check("open of /dev/pruss485-mon", mon >= 0);
+	if (mon < 0)
+		return;
+
+	/* The stream starts with a pcapng section header block */
+	check("pcapng section header",
+			read(mon, &block_type, sizeof(block_type)) == sizeof(block_type) && block_type == 0x0a0d0d0a);
+	check("PRUSS_MON_GET_DROPS", !ioctl(mon, PRUSS_MON_GET_DROPS, &drops) && drops != ~0u);
+
+	close(mon);
+}
+
+static void test_trace (void) {
+
+	char buffer[256];
+	int trace;
+
+	trace = open("/sys/class/pruss485/pruss485/trace", O_RDONLY);
+	check("open of the trace attribute", trace >= 0);
+	if (trace < 0)
+		return;
+
+	check("read of the trace attribute", read(trace, buffer, sizeof(buffer)) >= 0);
+
+	close(trace);
+}
+
+static void test_replies (int fd) {
+
+	struct pruss_reply reply = {
+		.req_len = 2,
+		.resp_len = 2,
+		.req = { 0x01, 0x10 },
+		.mask = { 0xff, 0xff },
+		.resp = { 0x00, 0x11 },
+	};
+	int idx;
+
+	idx = ioctl(fd, PRUSS_ADD_REPLY, &reply);
+	check("PRUSS_ADD_REPLY", idx >= 0);
+	check("PRUSS_DEL_REPLY", idx >= 0 && !ioctl(fd, PRUSS_DEL_REPLY, idx));
+	check("PRUSS_DEL_REPLY out of range", FAILS(ioctl(fd, PRUSS_DEL_REPLY, REPLY_CACHE_SZ), EINVAL));
+
+	reply.req_len = 0;
+	check("PRUSS_ADD_REPLY empty request", FAILS(ioctl(fd, PRUSS_ADD_REPLY, &reply), EINVAL));
+
+	check("PRUSS_CLEAR_REPLIES", !ioctl(fd, PRUSS_CLEAR_REPLIES));
+}
+
+static void test_regmap (int fd) {
+
+	static struct pruss_regmap map;
+	long page = sysconf(_SC_PAGESIZE);
+	uint8_t changed[REGMAP_VARS_MAX / 8];
+	uint32_t *seq, start;
+	uint8_t *table;
+	int fd2;
+
+	map.n_vars = 1;
+	map.master_addr = 0x00;
+	map.vars[0] = (struct pruss_regmap_var) { .offset = 0, .size = 2, .flags = REGMAP_WRITABLE | REGMAP_NOTIFY };
+	check("PRUSS_SET_REGMAP", !ioctl(fd, PRUSS_SET_REGMAP, &map));
+
+	table = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PRUSS_MMAP_REGMAP * page);
+	check("mmap of the register table", table != MAP_FAILED);
+	if (table != MAP_FAILED) {
+		seq = (uint32_t *) (table + page - REGMAP_SEQ_SIZE);
+		do
+			start = __atomic_load_n(seq, __ATOMIC_RELAXED) & ~1u;
+		while (!__atomic_compare_exchange_n(seq, &start, start + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+		table[0] = 0x12;
+		table[1] = 0x34;
+		__atomic_store_n(seq, start + 2, __ATOMIC_RELEASE);
+		check("sequence counter of the register table", !(*seq & 1));
+		munmap(table, page);
+	}
+
+	/* Nothing was written by a master */
+	fd2 = open("/dev/pruss485", O_RDWR | O_NONBLOCK);
+	if (fd2 >= 0) {
+		check("PRUSS_REGMAP_WAIT without changes", FAILS(ioctl(fd2, PRUSS_REGMAP_WAIT, changed), EAGAIN));
+		close(fd2);
+	}
+
+	map.vars[0].offset = page - REGMAP_SEQ_SIZE;
+	check("PRUSS_SET_REGMAP over the sequence counter", FAILS(ioctl(fd, PRUSS_SET_REGMAP, &map), EINVAL));
+
+	map.vars[0].offset = 0;
+	map.vars[0].size = 0;
+	check("PRUSS_SET_REGMAP empty variable", FAILS(ioctl(fd, PRUSS_SET_REGMAP, &map), EINVAL));
+}
+
+static void test_poll (int fd) {
+
+	static struct pruss_poll_list list;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t size = POLL_ENTRIES_MAX * sizeof(struct pruss_poll_result);
+	void *results;
+
+	check("PRUSS_SET_POLL_LIST empty", !ioctl(fd, PRUSS_SET_POLL_LIST, &list));
+	check("PRUSS_START_POLL without entries", FAILS(ioctl(fd, PRUSS_START_POLL), EINVAL));
+
+	list.n_entries = 1;
+	list.entries[0] = (struct pruss_poll_entry) {
+		.period_us = 10000, .slot = 0, .req_len = 4, .resp_max = 16, .req = { 0x01, 0x10, 0x00, 0x00 },
+	};
+	check("PRUSS_SET_POLL_LIST", !ioctl(fd, PRUSS_SET_POLL_LIST, &list));
+	check("PRUSS_START_POLL", !ioctl(fd, PRUSS_START_POLL));
+	check("PRUSS_START_POLL twice", FAILS(ioctl(fd, PRUSS_START_POLL), EBUSY));
+	usleep(50000);
+	check("PRUSS_STOP_POLL", !ioctl(fd, PRUSS_STOP_POLL));
+
+	list.entries[0].period_us = 0;
+	check("PRUSS_SET_POLL_LIST zero period", FAILS(ioctl(fd, PRUSS_SET_POLL_LIST, &list), EINVAL));
+
+	/* The result table is read only, mprotect() included */
+	check("mmap of the poll results for writing",
+			mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PRUSS_MMAP_POLL * page) == MAP_FAILED &&
+			errno == EPERM);
+
+	results = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, PRUSS_MMAP_POLL * page);
+	check("mmap of the poll results", results != MAP_FAILED);
+	if (results != MAP_FAILED) {
+		check("mprotect of the poll results for writing", mprotect(results, size, PROT_READ | PROT_WRITE) < 0);
+		munmap(results, size);
+	}
+}
+
+static uint64_t now_ns (void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void test_send_at (int fd) {
+
+	uint8_t buf[256] = { 0x01, 0x10, 0x00, 0x00 };
+	struct pruss_txtime txtime = {
+		.launch_ns = now_ns() - 1000000000,
+		.buf = (uintptr_t) buf,
+		.len = 4,
+		.flags = PRUSS_TXTIME_DROP_LATE,
+	};
+
+	/* A launch time already past by a second is dropped before sending */
+	check("PRUSS_SEND_AT late", FAILS(ioctl(fd, PRUSS_SEND_AT, &txtime), ETIME));
+
+	txtime.flags = 0;
+	txtime.launch_ns = 0;
+	check("PRUSS_SEND_AT without a launch time", FAILS(ioctl(fd, PRUSS_SEND_AT, &txtime), EINVAL));
+
+	txtime.launch_ns = now_ns();
+	txtime.flags = 0x80;
+	check("PRUSS_SEND_AT unknown flags", FAILS(ioctl(fd, PRUSS_SEND_AT, &txtime), EINVAL));
+}
+
+/* Whether the module was loaded with a sync pulse event (sync_sysevt) */
+static int sync_timed (void) {
+
+	char buffer[16] = "";
+	int param;
+
+	param = open("/sys/module/uio_pruss/parameters/sync_sysevt", O_RDONLY);
+	if (param < 0)
+		return 0;
+
+	if (read(param, buffer, sizeof(buffer) - 1) < 0)
+		buffer[0] = 0;
+	close(param);
+
+	return atoi(buffer) >= 0 && buffer[0];
+}
+
+static void test_tdma (int fd) {
+
+	struct pruss_tdma_table table = {
+		.n_slots = 1,
+		.node = 1,
+		.slots = { { .offset_us = 100, .length_us = 500, .node = 1 } },
+	};
+
+	table.node = 0xff;
+	check("PRUSS_SET_TDMA broadcast node", FAILS(ioctl(fd, PRUSS_SET_TDMA, &table), EINVAL));
+
+	table.node = 1;
+	table.n_slots = TDMA_SLOTS_MAX + 1;
+	check("PRUSS_SET_TDMA too many slots", FAILS(ioctl(fd, PRUSS_SET_TDMA, &table), EINVAL));
+
+	table.n_slots = 1;
+	if (!sync_timed())
+		check("PRUSS_SET_TDMA without timed pulses", FAILS(ioctl(fd, PRUSS_SET_TDMA, &table), EOPNOTSUPP));
+	else {
+		check("PRUSS_SET_TDMA", !ioctl(fd, PRUSS_SET_TDMA, &table));
+
+		table.slots[0].length_us = 0;
+		check("PRUSS_SET_TDMA empty slot", FAILS(ioctl(fd, PRUSS_SET_TDMA, &table), EINVAL));
+
+		table.slots[0].length_us = 500;
+		table.slots[0].node = 2;
+		check("PRUSS_SET_TDMA no slot of the node", FAILS(ioctl(fd, PRUSS_SET_TDMA, &table), EINVAL));
+
+		table.n_slots = 2;
+		table.slots[1] = (struct pruss_tdma_slot) { .offset_us = 300, .length_us = 500, .node = 1 };
+		check("PRUSS_SET_TDMA overlapping slots", FAILS(ioctl(fd, PRUSS_SET_TDMA, &table), EINVAL));
+	}
+
+	table.n_slots = 0;
+	check("PRUSS_SET_TDMA disabled", !ioctl(fd, PRUSS_SET_TDMA, &table));
+}
+
+static void test_sync_page (int fd) {
+
+	long page = sysconf(_SC_PAGESIZE);
+	volatile struct pruss_sync_page *sync;
+
+	check("mmap of the sync page for writing",
+			mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PRUSS_MMAP_SYNC * page) == MAP_FAILED &&
+			errno == EPERM);
+	check("mmap of the sync page with a wrong size",
+			mmap(NULL, 2 * page, PROT_READ, MAP_SHARED, fd, PRUSS_MMAP_SYNC * page) == MAP_FAILED &&
+			errno == EINVAL);
+
+	sync = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, PRUSS_MMAP_SYNC * page);
+	check("mmap of the sync page", sync != MAP_FAILED);
+	if (sync != MAP_FAILED) {
+		/* Sync is stopped by PRUSS_MODE */
+		check("sync page state", !(sync->seq & 1) && !sync->state);
+		check("mprotect of the sync page for writing", mprotect((void *) sync, page, PROT_READ | PROT_WRITE) < 0);
+		munmap((void *) sync, page);
+	}
+}
+
+static void test_pulse_count64 (int fd) {
+
+	uint64_t count = ~0ull;
+
+	check("PRUSS_CLEAR_PULSE_COUNT64", !ioctl(fd, PRUSS_CLEAR_PULSE_COUNT64));
+	check("PRUSS_GET_PULSE_COUNT64", !ioctl(fd, PRUSS_GET_PULSE_COUNT64, &count) && !count);
+}
+
+static void test_sync_notify (int fd) {
+
+	struct pruss_sync_notify notify = { .eventfd = eventfd(0, EFD_NONBLOCK), .every = 1 };
+
+	check("PRUSS_SET_SYNC_NOTIFY", notify.eventfd >= 0 && !ioctl(fd, PRUSS_SET_SYNC_NOTIFY, &notify));
+
+	notify.every = 0;
+	check("PRUSS_SET_SYNC_NOTIFY every 0 pulses", FAILS(ioctl(fd, PRUSS_SET_SYNC_NOTIFY, &notify), EINVAL));
+
+	notify.every = 1;
+	close(notify.eventfd);
+	notify.eventfd = -1;
+	check("PRUSS_SET_SYNC_NOTIFY without eventfd", !ioctl(fd, PRUSS_SET_SYNC_NOTIFY, &notify));
+}
+
+static void test_sync_stats (int fd) {
+
+	struct pruss_sync_period period = { .period_ns = 1000000, .bucket_ns = 1000 };
+	struct pruss_sync_stats stats;
+
+	check("PRUSS_SET_SYNC_PERIOD", !ioctl(fd, PRUSS_SET_SYNC_PERIOD, &period));
+	check("PRUSS_RESET_SYNC_STATS", !ioctl(fd, PRUSS_RESET_SYNC_STATS));
+	check("PRUSS_GET_SYNC_STATS",
+			!ioctl(fd, PRUSS_GET_SYNC_STATS, &stats) && !stats.samples && stats.bucket_ns == 1000);
+
+	period.bucket_ns = 0;
+	check("PRUSS_SET_SYNC_PERIOD empty bucket", FAILS(ioctl(fd, PRUSS_SET_SYNC_PERIOD, &period), EINVAL));
+}
+
+static void test_clock_corr (int fd) {
+
+	struct pruss_clock_corr corr = { 0 };
+	struct pruss_time_conv conv = { .sys_ns = now_ns() };
+	uint64_t sys_ns = conv.sys_ns;
+	int i;
+
+	/* Conversions need two samples, taken a second apart */
+	for (i = 0; i < 30 && corr.samples < 2; i++) {
+		if (ioctl(fd, PRUSS_GET_CLOCK_CORR, &corr))
+			break;
+		usleep(100000);
+	}
+	check("PRUSS_GET_CLOCK_CORR", corr.samples >= 2);
+
+	/* A time converted back and forth comes back within rounding */
+	check("PRUSS_SYS_TO_IEP", !ioctl(fd, PRUSS_SYS_TO_IEP, &conv));
+	conv.sys_ns = 0;
+	check("PRUSS_IEP_TO_SYS", !ioctl(fd, PRUSS_IEP_TO_SYS, &conv) &&
+			conv.sys_ns + 1000 > sys_ns && conv.sys_ns < sys_ns + 1000);
+
+	conv.flags = 0x80;
+	check("PRUSS_IEP_TO_SYS unknown flags", FAILS(ioctl(fd, PRUSS_IEP_TO_SYS, &conv), EINVAL));
+}
+
+static void test_sync_delay (int fd) {
+
+	struct pruss_delay_calib calib = { .loop_ps = 10000, .overhead_ns = 0 };
+	struct pruss_sync_delay delay;
+
+	check("PRUSS_SET_DELAY_CALIB", !ioctl(fd, PRUSS_SET_DELAY_CALIB, &calib));
+	check("PRUSS_GET_SYNC_DELAY", !ioctl(fd, PRUSS_GET_SYNC_DELAY, &delay));
+
+	calib.overhead_ns = DELAY_OVERHEAD_NS_MAX + 1;
+	check("PRUSS_SET_DELAY_CALIB overhead too large", FAILS(ioctl(fd, PRUSS_SET_DELAY_CALIB, &calib), EINVAL));
+
+	calib.overhead_ns = 0;
+	calib.loop_ps = DELAY_LOOP_PS_MAX + 1;
+	check("PRUSS_SET_DELAY_CALIB loop too long", FAILS(ioctl(fd, PRUSS_SET_DELAY_CALIB, &calib), EINVAL));
+
+	calib.loop_ps = 0;
+	check("PRUSS_SET_DELAY_CALIB zero loop", FAILS(ioctl(fd, PRUSS_SET_DELAY_CALIB, &calib), EINVAL));
+}
+
+static void test_sync_steps (int fd) {
+
+	struct pruss_sync_step step = { .slot = 1, .addr = 0xff, .cmd = 0x51, .len = 1, .payload = { 0x01 } };
+	struct pruss_sync_step_sel sel = { .first = 1, .count = 1 };
+
+	check("PRUSS_SET_SYNC_STEP_SLOT", !ioctl(fd, PRUSS_SET_SYNC_STEP_SLOT, &step));
+	check("PRUSS_SELECT_SYNC_STEP", !ioctl(fd, PRUSS_SELECT_SYNC_STEP, &sel));
+
+	step.slot = SYNC_STEP_SLOTS;
+	check("PRUSS_SET_SYNC_STEP_SLOT out of range", FAILS(ioctl(fd, PRUSS_SET_SYNC_STEP_SLOT, &step), EINVAL));
+
+	step.slot = 1;
+	step.len = SYNC_STEP_PAYLOAD_MAX + 1;
+	check("PRUSS_SET_SYNC_STEP_SLOT too long", FAILS(ioctl(fd, PRUSS_SET_SYNC_STEP_SLOT, &step), EINVAL));
+
+	sel.count = 0;
+	check("PRUSS_SELECT_SYNC_STEP no slots", FAILS(ioctl(fd, PRUSS_SELECT_SYNC_STEP, &sel), EINVAL));
+
+	sel.first = SYNC_STEP_SLOTS - 1;
+	sel.count = 2;
+	check("PRUSS_SELECT_SYNC_STEP out of range", FAILS(ioctl(fd, PRUSS_SELECT_SYNC_STEP, &sel), EINVAL));
+
+	/* Back to the command loaded by PRUSS_SET_SYNC_STEP */
+	sel.first = 0;
+	sel.count = 1;
+	ioctl(fd, PRUSS_SELECT_SYNC_STEP, &sel);
+}
+
+static void test_stage_config (int fd) {
+
+	/* Sync is stopped, so the change is applied at once */
+	struct pruss_staged_config cfg = { .flags = PRUSS_STAGE_TIMEOUT | PRUSS_STAGE_WAIT, .timeout_ms = 8 };
+
+	check("PRUSS_STAGE_CONFIG", !ioctl(fd, PRUSS_STAGE_CONFIG, &cfg));
+
+	cfg.flags = 0x10;
+	check("PRUSS_STAGE_CONFIG unknown flags", FAILS(ioctl(fd, PRUSS_STAGE_CONFIG, &cfg), EINVAL));
+
+	cfg.flags = PRUSS_STAGE_BAUD;
+	cfg.baudrate = 7;
+	check("PRUSS_STAGE_CONFIG invalid baudrate", FAILS(ioctl(fd, PRUSS_STAGE_CONFIG, &cfg), EINVAL));
+}
+
+static void test_sync_window (int fd) {
+
+	struct pruss_sync_window window;
+
+	/* Sync is stopped by PRUSS_MODE, so no window is known */
+	check("PRUSS_GET_SYNC_WINDOW while sync is stopped",
+			FAILS(ioctl(fd, PRUSS_GET_SYNC_WINDOW, &window), EAGAIN));
+}
+
+static void test_submit (int fd) {
+
+	uint8_t req[4] = { 0x01, 0x10, 0x00, 0x00 }, resp[256];
+	struct pruss_completion comp = { 0 };
+	struct pruss_submit sub = {
+		.tag = 0x1234,
+		.req = (uintptr_t) req,
+		.resp = (uintptr_t) resp,
+		.req_len = sizeof(req),
+		.resp_max = sizeof(resp),
+	};
+	struct pruss_reap reap = { .completions = (uintptr_t) &comp, .max = 1 };
+
+	check("PRUSS_REAP without completions", !ioctl(fd, PRUSS_REAP, &reap));
+
+	check("PRUSS_SUBMIT", !ioctl(fd, PRUSS_SUBMIT, &sub));
+	reap.flags = PRUSS_REAP_WAIT;
+	check("PRUSS_REAP", ioctl(fd, PRUSS_REAP, &reap) == 1 && comp.tag == 0x1234);
+
+	reap.flags = 0x80;
+	check("PRUSS_REAP unknown flags", FAILS(ioctl(fd, PRUSS_REAP, &reap), EINVAL));
+
+	sub.req_len = 0;
+	check("PRUSS_SUBMIT empty request", FAILS(ioctl(fd, PRUSS_SUBMIT, &sub), EINVAL));
+}
+
+static void test_ring (void) {
+
+	struct pruss_ring_setup setup = { .entries = 3 };
+	long page = sysconf(_SC_PAGESIZE);
+	struct pruss_ring_hdr *hdr;
+	int fd2;
+
+	/* A ring is set up once per file */
+	fd2 = open("/dev/pruss485", O_RDWR);
+	if (fd2 < 0)
+		return;
+
+	check("PRUSS_RING_ENTER without a ring", FAILS(ioctl(fd2, PRUSS_RING_ENTER, 0), EINVAL));
+	check("PRUSS_SETUP_RING not a power of 2", FAILS(ioctl(fd2, PRUSS_SETUP_RING, &setup), EINVAL));
+
+	setup.entries = 8;
+	check("PRUSS_SETUP_RING", !ioctl(fd2, PRUSS_SETUP_RING, &setup) && setup.size);
+	check("PRUSS_SETUP_RING twice", FAILS(ioctl(fd2, PRUSS_SETUP_RING, &setup), EBUSY));
+
+	check("mmap of the ring with a wrong size",
+			mmap(NULL, setup.size + page, PROT_READ | PROT_WRITE, MAP_SHARED, fd2, PRUSS_MMAP_RING * page) == MAP_FAILED);
+
+	hdr = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd2, PRUSS_MMAP_RING * page);
+	check("mmap of the ring", hdr != MAP_FAILED);
+	if (hdr != MAP_FAILED) {
+		check("ring header", hdr->sq_entries == 8 && hdr->sq_head == hdr->sq_tail);
+		check("PRUSS_RING_ENTER", !ioctl(fd2, PRUSS_RING_ENTER, 0));
+		munmap(hdr, setup.size);
+	}
+
+	close(fd2);
+}
+
+static void test_iovec (void) {
+
+	uint8_t head[2] = { 0x01, 0x10 }, tail[2] = { 0x00, 0x00 }, answer[256];
+	struct iovec out[2] = { { head, sizeof(head) }, { tail, sizeof(tail) } };
+	struct iovec in = { answer, sizeof(answer) };
+	ssize_t ret;
+	int fd2;
+
+	fd2 = open("/dev/pruss485", O_RDWR | O_NONBLOCK);
+	if (fd2 < 0)
+		return;
+
+	/* Nothing was written on this file yet */
+	ret = readv(fd2, &in, 1);
+	check("readv without answer", ret < 0 && errno == EAGAIN);
+
+	/* The request is gathered from both buffers */
+	check("writev", writev(fd2, out, 2) == sizeof(head) + sizeof(tail));
+
+	close(fd2);
+}
+
+static void test_cancel (int fd) {
+
+	check("PRUSS_SET_DEADLINE", !ioctl(fd, PRUSS_SET_DEADLINE, 100));
+	check("PRUSS_CANCEL", !ioctl(fd, PRUSS_CANCEL, 0));
+	check("PRUSS_CANCEL all files", !ioctl(fd, PRUSS_CANCEL, PRUSS_CANCEL_ALL));
+	check("PRUSS_CANCEL unknown flags", FAILS(ioctl(fd, PRUSS_CANCEL, 0x80), EINVAL));
+	check("PRUSS_SET_DEADLINE none", !ioctl(fd, PRUSS_SET_DEADLINE, 0));
+}
+
+static void test_priority (int fd) {
+
+	check("PRUSS_SET_PRIORITY bulk", !ioctl(fd, PRUSS_SET_PRIORITY, PRUSS_PRIO_BULK));
+	check("PRUSS_SET_PRIORITY unknown class", FAILS(ioctl(fd, PRUSS_SET_PRIORITY, PRUSS_PRIO_NR), EINVAL));
+	check("PRUSS_SET_PRIORITY cyclic", !ioctl(fd, PRUSS_SET_PRIORITY, PRUSS_PRIO_CYCLIC));
+}
+
+static void test_weight (int fd) {
+
+	struct pruss_client_stats stats;
+
+	check("PRUSS_SET_WEIGHT", !ioctl(fd, PRUSS_SET_WEIGHT, 8));
+	check("PRUSS_SET_WEIGHT zero", FAILS(ioctl(fd, PRUSS_SET_WEIGHT, 0), EINVAL));
+	check("PRUSS_SET_WEIGHT too large", FAILS(ioctl(fd, PRUSS_SET_WEIGHT, XFER_WEIGHT_MAX + 1), EINVAL));
+	check("PRUSS_GET_CLIENT_STATS",
+			!ioctl(fd, PRUSS_GET_CLIENT_STATS, &stats) && stats.weight == 8 && !stats.queued);
+}
 
 int main () {
 
@@ -56,9 +615,36 @@ int main () {
 			printf("\n");
 	}
 
+	printf("Running the smoke checks...\n");
+	test_addr_filter(fd);
+	test_bpf_filter(fd);
+	test_readers();
+	test_monitor();
+	test_trace();
+	test_replies(fd);
+	test_regmap(fd);
+	test_poll(fd);
+	test_send_at(fd);
+	test_tdma(fd);
+	test_sync_page(fd);
+	test_pulse_count64(fd);
+	test_sync_notify(fd);
+	test_sync_stats(fd);
+	test_clock_corr(fd);
+	test_sync_delay(fd);
+	test_sync_steps(fd);
+	test_stage_config(fd);
+	test_sync_window(fd);
+	test_submit(fd);
+	test_ring();
+	test_iovec();
+	test_cancel(fd);
+	test_priority(fd);
+	test_weight(fd);
+
 	printf("End of the program\n");
 
 	close(fd);
 
-	return 0;
+	return failures ? 1 : 0;
 }